@@ -4,53 +4,11 @@
  * All rights reserved. Distributed under the terms of the MIT license.
  */
 #include <stdio.h>
-#include <QThread>
-#include <QElapsedTimer>
 #include <QCoreApplication>
 
 #include <QMidiOut.h>
 #include <QMidiFile.h>
-
-class MidiPlayer : public QThread
-{
-	Q_OBJECT
-public:
-	MidiPlayer(QMidiFile* file, QMidiOut* out)
-	{
-		midi_file = file;
-		midi_out = out;
-	}
-
-private:
-	QMidiFile* midi_file;
-	QMidiOut* midi_out;
-
-protected:
-	void run()
-	{
-		QElapsedTimer t;
-		t.start();
-		QList<QMidiEvent*> events = midi_file->events();
-		for (QMidiEvent* e : events) {
-			if (e->type() != QMidiEvent::Meta) {
-				qint64 event_time = midi_file->timeFromTick(e->tick()) * 1000;
-
-				qint32 waitTime = event_time - t.elapsed();
-				if (waitTime > 0) {
-					msleep(waitTime);
-				}
-				if (e->type() == QMidiEvent::SysEx) {
-					// TODO: sysex
-				} else {
-					qint32 message = e->message();
-					midi_out->sendMsg(message);
-				}
-			}
-		}
-
-		midi_out->disconnect();
-	}
-};
+#include <QMidiPlayer.h>
 
 static void usage(char* program_name)
 {
@@ -96,11 +54,11 @@ int main(int argc, char* argv[])
 	QMidiOut* midi_out = new QMidiOut();
 	midi_out->connect(midiOutName);
 
-	MidiPlayer* p = new MidiPlayer(midi_file, midi_out);
+	QMidiPlayer* p = new QMidiPlayer(midi_file, midi_out);
 	QObject::connect(p, SIGNAL(finished()), &a, SLOT(quit()));
-	p->start();
+	p->play();
 
-	return a.exec();
+	int ret = a.exec();
+	midi_out->disconnect();
+	return ret;
 }
-
-#include "playsmf.moc"
@@ -8,14 +8,27 @@
 
 #include <QByteArray>
 #include <QStringList>
+#include <QVector>
 #include <alsa/asoundlib.h>
 #include <alsa/seq.h>
 #include <alsa/seq_midi_event.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
 // # pragma mark - QMidiOut
 
 struct NativeMidiOutInstances {
 	snd_seq_t* midiOutPtr;
+	//! \brief encoder turns system messages (which have no snd_seq_ev_set_*
+	//! helper) into events; kept for the whole connection.
+	snd_midi_event_t* encoder;
+	//! \brief queue is the ALSA queue scheduled messages are sent through, or
+	//! -1 if QMidiOut::startSchedule was not called.
+	int queue;
 };
 
 // TODO: error reporting
@@ -77,12 +90,19 @@ bool QMidiOut::connect(QString outDeviceId)
 	if (fConnected)
 		disconnect();
 	fMidiPtrs = new NativeMidiOutInstances;
+	fMidiPtrs->queue = -1;
 
 	int err = snd_seq_open(&fMidiPtrs->midiOutPtr, "default", SND_SEQ_OPEN_OUTPUT, 0);
 	if (err < 0) {
 		delete fMidiPtrs;
 		return false;
 	}
+	err = snd_midi_event_new(3, &fMidiPtrs->encoder);
+	if (err < 0) {
+		snd_seq_close(fMidiPtrs->midiOutPtr);
+		delete fMidiPtrs;
+		return false;
+	}
 	snd_seq_set_client_name(fMidiPtrs->midiOutPtr, "QMidi");
 
 	snd_seq_create_simple_port(fMidiPtrs->midiOutPtr, "Output Port", SND_SEQ_PORT_CAP_READ,
@@ -107,62 +127,191 @@ void QMidiOut::disconnect()
 	int client = l.at(0).toInt();
 	int port = l.at(1).toInt();
 
+	stopAsync();
+	stopSchedule();
 	snd_seq_disconnect_from(fMidiPtrs->midiOutPtr, 0, client, port);
 	fConnected = false;
 
+	snd_midi_event_free(fMidiPtrs->encoder);
 	snd_seq_close(fMidiPtrs->midiOutPtr);
 	delete fMidiPtrs;
 	fMidiPtrs = NULL;
 }
 
-void QMidiOut::sendMsg(qint32 msg)
+/* Channel messages are built directly, which is much cheaper than going
+ * through a snd_midi_event_t parser for each message. */
+static bool encode_msg(NativeMidiOutInstances* midiPtrs, qint32 msg, snd_seq_event_t* ev)
+{
+	unsigned char status = msg & 0xFF;
+	unsigned char channel = status & 0x0F;
+	unsigned char data1 = (msg >> 8) & 0x7F;
+	unsigned char data2 = (msg >> 16) & 0x7F;
+
+	snd_seq_ev_clear(ev);
+	snd_seq_ev_set_source(ev, 0);
+	snd_seq_ev_set_subs(ev);
+
+	switch (status & 0xF0) {
+	case 0x80:
+		snd_seq_ev_set_noteoff(ev, channel, data1, data2);
+		return true;
+	case 0x90:
+		snd_seq_ev_set_noteon(ev, channel, data1, data2);
+		return true;
+	case 0xA0:
+		snd_seq_ev_set_keypress(ev, channel, data1, data2);
+		return true;
+	case 0xB0:
+		snd_seq_ev_set_controller(ev, channel, data1, data2);
+		return true;
+	case 0xC0:
+		snd_seq_ev_set_pgmchange(ev, channel, data1);
+		return true;
+	case 0xD0:
+		snd_seq_ev_set_chanpress(ev, channel, data1);
+		return true;
+	case 0xE0:
+		snd_seq_ev_set_pitchbend(ev, channel, ((data2 << 7) | data1) - 8192);
+		return true;
+	case 0xF0: {
+		unsigned char buf[3];
+		buf[0] = status;
+		buf[1] = data1;
+		buf[2] = data2;
+		snd_midi_event_reset_encode(midiPtrs->encoder);
+		for (int i = 0; i < 3; i++) {
+			if (snd_midi_event_encode_byte(midiPtrs->encoder, buf[i], ev) > 0)
+				return true;
+		}
+		return false;
+	}
+	default:
+		return false;
+	}
+}
+
+static void encode_sysex(const QByteArray &data, snd_seq_event_t* ev)
+{
+	snd_seq_ev_clear(ev);
+	snd_seq_ev_set_source(ev, 0);
+	snd_seq_ev_set_subs(ev);
+	/* the data is copied into the output buffer by snd_seq_event_output() */
+	snd_seq_ev_set_sysex(ev, data.size(), const_cast<char*>(data.constData()));
+}
+
+void QMidiOut::outputMsg(qint32 msg)
 {
 	if (!fConnected)
 		return;
 
-	char buf[3];
-	buf[0] = msg & 0xFF;
-	buf[1] = (msg >> 8) & 0xFF;
-	buf[2] = (msg >> 16) & 0xFF;
-
 	snd_seq_event_t ev;
-	snd_midi_event_t* mev;
-
-	snd_seq_ev_clear(&ev);
-	snd_seq_ev_set_source(&ev, 0);
-	snd_seq_ev_set_subs(&ev);
+	if (!encode_msg(fMidiPtrs, msg, &ev))
+		return;
 	snd_seq_ev_set_direct(&ev);
 
-	snd_midi_event_new(3, &mev);
-	snd_midi_event_resize_buffer(mev, 3);
-	snd_midi_event_encode(mev, (unsigned char*)&buf, 3, &ev);
+	/* only drains by itself once the output buffer is full; see flush() */
+	snd_seq_event_output(fMidiPtrs->midiOutPtr, &ev);
+}
+
+void QMidiOut::sendSysEx(const QByteArray &data)
+{
+	if (!fConnected)
+		return;
+
+	snd_seq_event_t ev;
+	encode_sysex(data, &ev);
+	snd_seq_ev_set_direct(&ev);
 
 	snd_seq_event_output(fMidiPtrs->midiOutPtr, &ev);
+	if (fAutoFlush)
+		snd_seq_drain_output(fMidiPtrs->midiOutPtr);
+}
+
+void QMidiOut::flush()
+{
+	if (!fConnected)
+		return;
+
 	snd_seq_drain_output(fMidiPtrs->midiOutPtr);
+}
 
-	snd_midi_event_free(mev);
+bool QMidiOut::startSchedule()
+{
+	if (!fConnected)
+		return false;
+
+	stopSchedule();
+	fMidiPtrs->queue = snd_seq_alloc_named_queue(fMidiPtrs->midiOutPtr, "QMidi");
+	if (fMidiPtrs->queue < 0) {
+		fMidiPtrs->queue = -1;
+		return false;
+	}
+	/* the queue's real time counts from 0 once it is started */
+	snd_seq_start_queue(fMidiPtrs->midiOutPtr, fMidiPtrs->queue, NULL);
+	snd_seq_drain_output(fMidiPtrs->midiOutPtr);
+	return true;
 }
 
-void QMidiOut::sendSysEx(const QByteArray &data)
+void QMidiOut::stopSchedule()
+{
+	if (!fConnected || (fMidiPtrs->queue < 0))
+		return;
+
+	/* removes the events on the queue both from the output buffer here and
+	 * from the kernel; snd_seq_drop_output() would also throw away direct
+	 * messages not drained yet, e.g. NoteOffs sent with auto-flush off */
+	snd_seq_remove_events_t* remove;
+	snd_seq_remove_events_alloca(&remove);
+	snd_seq_remove_events_set_queue(remove, fMidiPtrs->queue);
+	snd_seq_remove_events_set_condition(remove, SND_SEQ_REMOVE_OUTPUT);
+	snd_seq_remove_events(fMidiPtrs->midiOutPtr, remove);
+
+	snd_seq_stop_queue(fMidiPtrs->midiOutPtr, fMidiPtrs->queue, NULL);
+	snd_seq_drain_output(fMidiPtrs->midiOutPtr);
+	snd_seq_free_queue(fMidiPtrs->midiOutPtr, fMidiPtrs->queue);
+	fMidiPtrs->queue = -1;
+}
+
+static void schedule_event(snd_seq_event_t* ev, int queue, qint64 nsecs)
+{
+	snd_seq_real_time_t time;
+	time.tv_sec = (unsigned int)(nsecs / 1000000000);
+	time.tv_nsec = (unsigned int)(nsecs % 1000000000);
+	snd_seq_ev_schedule_real(ev, queue, 0, &time);
+}
+
+void QMidiOut::scheduleMsg(qint32 msg, qint64 nsecs)
 {
 	if (!fConnected)
 		return;
+	if ((fMidiPtrs->queue < 0) || (nsecs < 0)) {
+		sendMsg(msg);
+		return;
+	}
 
 	snd_seq_event_t ev;
-	snd_midi_event_t* mev;
+	if (!encode_msg(fMidiPtrs, msg, &ev))
+		return;
+	schedule_event(&ev, fMidiPtrs->queue, nsecs);
 
-	snd_seq_ev_set_source(&ev, 0);
-	snd_seq_ev_set_subs(&ev);
-	snd_seq_ev_set_direct(&ev);
+	/* only drains by itself once the output buffer is full; see flush() */
+	snd_seq_event_output(fMidiPtrs->midiOutPtr, &ev);
+}
+
+void QMidiOut::scheduleSysEx(const QByteArray &data, qint64 nsecs)
+{
+	if (!fConnected)
+		return;
+	if ((fMidiPtrs->queue < 0) || (nsecs < 0)) {
+		sendSysEx(data);
+		return;
+	}
 
-	snd_midi_event_new(data.size(), &mev);
-	snd_midi_event_resize_buffer(mev, data.size());
-	snd_midi_event_encode(mev, (unsigned char*) data.data(), data.size(), &ev);
+	snd_seq_event_t ev;
+	encode_sysex(data, &ev);
+	schedule_event(&ev, fMidiPtrs->queue, nsecs);
 
 	snd_seq_event_output(fMidiPtrs->midiOutPtr, &ev);
-	snd_seq_drain_output(fMidiPtrs->midiOutPtr);
-
-	snd_midi_event_free(mev);
 }
 
 // # pragma mark - QMidiIn
@@ -173,6 +322,15 @@ struct NativeMidiInInstances {
 
 	//! \brief receiveThread is a reference to the MIDI input receive thread.
 	QMidiInternal::MidiInReceiveThread* receiveThread;
+	//! \brief wakePipe is written to by QMidiIn::stop to wake the receive
+	//! thread up from poll().
+	int wakePipe[2];
+	//! \brief queue is the ALSA queue that stamps incoming events with its
+	//! real time on arrival.
+	int queue;
+	//! \brief queueOrigin is the QMidiIn::timestampNow time at which
+	//! \c queue started.
+	qint64 queueOrigin;
 };
 
 QMap<QString, QString> QMidiIn::devices()
@@ -180,20 +338,62 @@ QMap<QString, QString> QMidiIn::devices()
 	return buildDevicesMap(true);
 }
 
+/* Starts the timestamping queue and finds out when its real time was zero,
+ * by reading it in between two readings of our own clock. */
+static void start_queue(NativeMidiInInstances* midiPtrs)
+{
+	midiPtrs->queueOrigin = QMidiIn::timestampNow();
+	if (midiPtrs->queue < 0)
+		return;
+
+	snd_seq_start_queue(midiPtrs->midiIn, midiPtrs->queue, NULL);
+	snd_seq_drain_output(midiPtrs->midiIn);
+
+	snd_seq_queue_status_t* status;
+	snd_seq_queue_status_alloca(&status);
+	const qint64 before = QMidiIn::timestampNow();
+	if (snd_seq_get_queue_status(midiPtrs->midiIn, midiPtrs->queue, status) < 0)
+		return;
+	const qint64 after = QMidiIn::timestampNow();
+
+	const snd_seq_real_time_t* time = snd_seq_queue_status_get_real_time(status);
+	midiPtrs->queueOrigin = before + (after - before) / 2
+		- ((qint64)time->tv_sec * 1000000000 + time->tv_nsec);
+}
+
 bool QMidiIn::connect(QString inDeviceId)
 {
 	if (fConnected)
 		disconnect();
 
 	fMidiPtrs = new NativeMidiInInstances;
-	int err = snd_seq_open(&fMidiPtrs->midiIn, "default", SND_SEQ_OPEN_INPUT, 0);
+	fMidiPtrs->receiveThread = nullptr;
+	/* duplex, as starting the queue is done by sending an event */
+	int err = snd_seq_open(&fMidiPtrs->midiIn, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK);
 	if (err < 0) {
 		delete fMidiPtrs;
 		return false;
 	}
+	if (pipe2(fMidiPtrs->wakePipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		snd_seq_close(fMidiPtrs->midiIn);
+		delete fMidiPtrs;
+		return false;
+	}
 	snd_seq_set_client_name(fMidiPtrs->midiIn, "QMidi");
-	snd_seq_create_simple_port(fMidiPtrs->midiIn, "Input Port", SND_SEQ_PORT_CAP_WRITE,
-		SND_SEQ_PORT_TYPE_MIDI_GENERIC);
+
+	fMidiPtrs->queue = snd_seq_alloc_named_queue(fMidiPtrs->midiIn, "QMidi Input");
+	snd_seq_port_info_t* info;
+	snd_seq_port_info_alloca(&info);
+	snd_seq_port_info_set_name(info, "Input Port");
+	snd_seq_port_info_set_capability(info, SND_SEQ_PORT_CAP_WRITE);
+	snd_seq_port_info_set_type(info, SND_SEQ_PORT_TYPE_MIDI_GENERIC);
+	if (fMidiPtrs->queue >= 0) {
+		snd_seq_port_info_set_timestamping(info, 1);
+		snd_seq_port_info_set_timestamp_real(info, 1);
+		snd_seq_port_info_set_timestamp_queue(info, fMidiPtrs->queue);
+	}
+	snd_seq_create_port(fMidiPtrs->midiIn, info);
+	start_queue(fMidiPtrs);
 
 	// connect the device to our previously created port
 	QStringList l = inDeviceId.split(":");
@@ -211,6 +411,8 @@ void QMidiIn::disconnect()
 	if (!fConnected)
 		return;
 
+	stop();
+
 	QStringList l = fDeviceId.split(":");
 	int client = l.at(0).toInt();
 	int port = l.at(1).toInt();
@@ -218,6 +420,10 @@ void QMidiIn::disconnect()
 	snd_seq_disconnect_to(fMidiPtrs->midiIn, 0, client, port);
 	fConnected = false;
 
+	close(fMidiPtrs->wakePipe[0]);
+	close(fMidiPtrs->wakePipe[1]);
+	if (fMidiPtrs->queue >= 0)
+		snd_seq_free_queue(fMidiPtrs->midiIn, fMidiPtrs->queue);
 	snd_seq_close(fMidiPtrs->midiIn);
 	delete fMidiPtrs;
 	fMidiPtrs = nullptr;
@@ -225,7 +431,7 @@ void QMidiIn::disconnect()
 
 void QMidiIn::start()
 {
-	if (!fConnected)
+	if (!fConnected || (fMidiPtrs->receiveThread != nullptr))
 		return;
 
 	fMidiPtrs->receiveThread = new QMidiInternal::MidiInReceiveThread(this, fMidiPtrs);
@@ -234,80 +440,131 @@ void QMidiIn::start()
 
 void QMidiIn::stop()
 {
-	if (!fConnected)
+	if (!fConnected || (fMidiPtrs->receiveThread == nullptr))
 		return;
 
-	fMidiPtrs->receiveThread->requestInterruption();
+	const char wake = 0;
+	while ((write(fMidiPtrs->wakePipe[1], &wake, 1) < 0) && (errno == EINTR))
+		;
 	fMidiPtrs->receiveThread->wait();
-	fMidiPtrs->receiveThread->deleteLater();
+	delete fMidiPtrs->receiveThread;
 	fMidiPtrs->receiveThread = nullptr;
+
+	/* empty the pipe again for the next start() */
+	char buf[16];
+	while (read(fMidiPtrs->wakePipe[0], buf, sizeof(buf)) > 0)
+		;
 }
 
 QMidiInternal::MidiInReceiveThread::MidiInReceiveThread(QMidiIn* qMidiIn, NativeMidiInInstances* fMidiPtrs, QObject* parent)
 	: QThread(parent), fMidiIn(qMidiIn), fMidiPtrs(fMidiPtrs)
 {}
 
-void QMidiInternal::MidiInReceiveThread::run()
+static void dispatch_event(QMidiIn* midiIn, NativeMidiInInstances* midiPtrs, const snd_seq_event_t* ev)
 {
-	snd_seq_event_t* ev = nullptr;
 	int data = 0;
 	int value = 0;
 
-	while (!isInterruptionRequested() && fMidiIn->isConnected()) {
-		snd_seq_event_input(fMidiPtrs->midiIn, &ev);
+	/* the queue stamped the event on arrival; fall back to now if not */
+	qint64 timestamp;
+	if ((ev->flags & SND_SEQ_TIME_STAMP_MASK) == SND_SEQ_TIME_STAMP_REAL) {
+		timestamp = midiPtrs->queueOrigin
+			+ (qint64)ev->time.time.tv_sec * 1000000000 + ev->time.time.tv_nsec;
+	} else {
+		timestamp = QMidiIn::timestampNow();
+	}
+
+	switch (ev->type) {
+	case SND_SEQ_EVENT_SYSEX:
+		/* long messages arrive in pieces, which QMidiIn puts back together */
+		midiIn->dispatchSysEx(reinterpret_cast<const char*>(ev->data.ext.ptr),
+			static_cast<int>(ev->data.ext.len), timestamp);
+		return;
+	case SND_SEQ_EVENT_NOTEOFF:
+		data = 0x80
+				| (ev->data.note.channel & 0x0F)
+				| ((ev->data.note.note & 0x7F) << 8)
+				| ((ev->data.note.velocity & 0x7F) << 16);
+		break;
+	case SND_SEQ_EVENT_NOTEON:
+		data = 0x90
+				| (ev->data.note.channel & 0x0F)
+				| ((ev->data.note.note & 0x7F) << 8)
+				| ((ev->data.note.velocity & 0x7F) << 16);
+		break;
+	case SND_SEQ_EVENT_KEYPRESS:
+		data = 0xA0
+				| (ev->data.note.channel & 0x0F)
+				| ((ev->data.note.note & 0x7F) << 8)
+				| ((ev->data.note.velocity & 0x7F) << 16);
+		break;
+	case SND_SEQ_EVENT_CONTROLLER:
+		data = 0xB0
+				| (ev->data.control.channel & 0x0F)
+				| ((ev->data.control.param & 0x7F) << 8)
+				| ((ev->data.control.value & 0x7F) << 16);
+		break;
+	case SND_SEQ_EVENT_PGMCHANGE:
+		data = 0xC0
+				| (ev->data.control.channel & 0x0F)
+				| ((ev->data.control.value & 0x7F) << 8);
+		break;
+	case SND_SEQ_EVENT_CHANPRESS:
+		data = 0xD0
+				| (ev->data.control.channel & 0x0F)
+				| ((ev->data.control.value & 0x7F) << 8);
+		break;
+	case SND_SEQ_EVENT_PITCHBEND:
+		value = ev->data.control.value + 8192;
+		data = 0xE0
+				| (ev->data.note.channel & 0x0F)
+				| ((value & 0x7F) << 8)
+				| (((value >> 7) & 0x7F) << 16);
+		break;
+	default:
+		return;
+	}
+
+	const quint32 timing = static_cast<quint32>((timestamp - midiPtrs->queueOrigin) / 1000000);
+	midiIn->dispatchMessage(static_cast<quint32>(data), timing, timestamp);
+}
 
-		switch (ev->type) {
-		case SND_SEQ_EVENT_SYSEX:
-		{
-			QByteArray ba = QByteArray(reinterpret_cast<const char*>(ev->data.ext.ptr), ev->data.ext.len);
-			emit(fMidiIn->midiSysExEvent(ba));
-			continue;
+/* Sleeps in poll() on the sequencer's descriptors and the wake pipe, so stop()
+ * returns right away, and reads every pending event on each wake-up. */
+void QMidiInternal::MidiInReceiveThread::run()
+{
+	snd_seq_t* seq = fMidiPtrs->midiIn;
+	const int count = snd_seq_poll_descriptors_count(seq, POLLIN);
+	QVector<struct pollfd> fds(count + 1);
+	snd_seq_poll_descriptors(seq, fds.data(), count, POLLIN);
+	fds[count].fd = fMidiPtrs->wakePipe[0];
+	fds[count].events = POLLIN;
+
+	forever {
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			qWarning("QMidi_ALSA: poll() failed: %s", strerror(errno));
+			return;
 		}
-		case SND_SEQ_EVENT_NOTEOFF:
-			data = 0x80
-					| (ev->data.note.channel & 0x0F)
-					| ((ev->data.note.note & 0x7F) << 8)
-					| ((ev->data.note.velocity & 0x7F) << 16);
-			break;
-		case SND_SEQ_EVENT_NOTEON:
-			data = 0x90
-					| (ev->data.note.channel & 0x0F)
-					| ((ev->data.note.note & 0x7F) << 8)
-					| ((ev->data.note.velocity & 0x7F) << 16);
-			break;
-		case SND_SEQ_EVENT_KEYPRESS:
-			data = 0xA0
-					| (ev->data.note.channel & 0x0F)
-					| ((ev->data.note.note & 0x7F) << 8)
-					| ((ev->data.note.velocity & 0x7F) << 16);
-			break;
-		case SND_SEQ_EVENT_CONTROLLER:
-			data = 0xB0
-					| (ev->data.control.channel & 0x0F)
-					| ((ev->data.control.param & 0x7F) << 8)
-					| ((ev->data.control.value & 0x7F) << 16);
-			break;
-		case SND_SEQ_EVENT_PGMCHANGE:
-			data = 0xC0
-					| (ev->data.control.channel & 0x0F)
-					| ((ev->data.control.value & 0x7F) << 8);
-			break;
-		case SND_SEQ_EVENT_CHANPRESS:
-			data = 0xD0
-					| (ev->data.control.channel & 0x0F)
-					| ((ev->data.control.value & 0x7F) << 8);
-			break;
-		case SND_SEQ_EVENT_PITCHBEND:
-			value = ev->data.control.value + 8192;
-			data = 0xE0
-					| (ev->data.note.channel & 0x0F)
-					| ((value & 0x7F) << 8)
-					| (((value >> 7) & 0x7F) << 16);
-			break;
-		default:
-			continue;
+		if (fds[count].revents != 0)
+			return;
+
+		forever {
+			snd_seq_event_t* ev = nullptr;
+			const int err = snd_seq_event_input(seq, &ev);
+			if (err == -EAGAIN)
+				break;
+			if (err == -ENOSPC) {
+				qWarning("QMidi_ALSA: input overrun, events were lost");
+				continue;
+			}
+			if (err < 0) {
+				qWarning("QMidi_ALSA: snd_seq_event_input() failed: %s", snd_strerror(err));
+				break;
+			}
+			if (ev != nullptr)
+				dispatch_event(fMidiIn, fMidiPtrs, ev);
 		}
-
-		emit(fMidiIn->midiEvent(static_cast<quint32>(data), ev->time.tick));
 	}
 }
@@ -11,9 +11,9 @@ struct NativeMidiInInstances;
 
 namespace QMidiInternal
 {
-//! \brief The MidiInReceiveThread class runs the ALSA MIDI input thread.  This
-//! is required since the function that reads input from a \c snd_seq_t handle
-//! blocks.
+//! \brief The MidiInReceiveThread class runs the ALSA MIDI input thread.  It
+//! waits in \c poll() for the \c snd_seq_t handle to have input, or for
+//! QMidiIn::stop to wake it up through a pipe.
 class MidiInReceiveThread : public QThread
 {
 	Q_OBJECT
@@ -15,6 +15,7 @@ struct NativeMidiOutInstances {
 	MIDIClientRef client;
 	MIDIPortRef outputPort;
 	MIDIEndpointRef destinationId;
+	MIDITimeStamp scheduleStart;
 };
 
 // TODO: error reporting
@@ -52,6 +53,7 @@ bool QMidiOut::connect(QString outDeviceId)
 
 	OSStatus result;
 	fMidiPtrs = new NativeMidiOutInstances;
+	fMidiPtrs->scheduleStart = 0;
 
 	QString name = "QMidi Output Client";
 	result = MIDIClientCreate(name.toCFString(), nullptr, nullptr,
@@ -84,6 +86,8 @@ void QMidiOut::disconnect()
 	if (!fConnected)
 		return;
 
+	stopAsync();
+
 	if (fMidiPtrs->destinationId != 0) {
 		MIDIEndpointDispose(fMidiPtrs->destinationId);
 		fMidiPtrs->destinationId = 0;
@@ -105,7 +109,7 @@ void QMidiOut::disconnect()
 	fMidiPtrs = 0;
 }
 
-void QMidiOut::sendMsg(qint32 msg)
+void QMidiOut::outputMsg(qint32 msg)
 {
 	if (!fConnected)
 		return;
@@ -136,6 +140,67 @@ void QMidiOut::sendSysEx(const QByteArray &data)
 	MIDISendSysex(&request);
 }
 
+bool QMidiOut::startSchedule()
+{
+	if (!fConnected)
+		return false;
+
+	stopSchedule();
+	fMidiPtrs->scheduleStart = AudioGetCurrentHostTime();
+	return true;
+}
+
+void QMidiOut::stopSchedule()
+{
+	if (!fConnected)
+		return;
+
+	MIDIFlushOutput(fMidiPtrs->destinationId);
+}
+
+/* CoreMIDI delivers packets with a future time stamp by itself */
+static void send_at(NativeMidiOutInstances* midiPtrs, const Byte* data, int length,
+	qint64 nsecs)
+{
+	MIDITimeStamp timeStamp = midiPtrs->scheduleStart
+		+ AudioConvertNanosToHostTime((UInt64)(nsecs < 0 ? 0 : nsecs));
+
+	QByteArray buffer(sizeof(MIDIPacketList) + length, 0);
+	MIDIPacketList* packetList = (MIDIPacketList*)buffer.data();
+	MIDIPacket* packet = MIDIPacketListInit(packetList);
+	packet = MIDIPacketListAdd(packetList, buffer.size(), packet, timeStamp, length, data);
+	if (packet == nullptr)
+		return;
+
+	MIDISend(midiPtrs->outputPort, midiPtrs->destinationId, packetList);
+}
+
+void QMidiOut::scheduleMsg(qint32 msg, qint64 nsecs)
+{
+	if (!fConnected)
+		return;
+
+	Byte data[3];
+	data[0] = msg & 0xFF;
+	data[1] = (msg >> 8) & 0xFF;
+	data[2] = (msg >> 16) & 0xFF;
+	int length = (((data[0] & 0xF0) == 0xC0) || ((data[0] & 0xF0) == 0xD0)) ? 2 : 3;
+	send_at(fMidiPtrs, data, length, nsecs);
+}
+
+void QMidiOut::scheduleSysEx(const QByteArray &data, qint64 nsecs)
+{
+	if (!fConnected)
+		return;
+
+	send_at(fMidiPtrs, (const Byte*)data.constData(), data.size(), nsecs);
+}
+
+void QMidiOut::flush()
+{
+	/* MIDISend() already hands everything to the system */
+}
+
 // # pragma mark - QMidiIn
 
 struct NativeMidiInInstances {
@@ -153,6 +218,9 @@ static void QMidiInReadProc(const MIDIPacketList *list, void *readProc,
 
 	for (UInt32 index = 0; index < list->numPackets; index++) {
 		UInt16 byteCount = packet->length;
+		/* host time is the clock QMidiIn::timestampNow() reads on macOS */
+		const qint64 timestamp = (packet->timeStamp != 0)
+			? (qint64)AudioConvertHostTimeToNanos(packet->timeStamp) : QMidiIn::timestampNow();
 
 		// Check that MIDIPacket has data in 3-byte groups
 		if (byteCount != 0 && (byteCount % 3) == 0) {
@@ -164,7 +232,7 @@ static void QMidiInReadProc(const MIDIPacketList *list, void *readProc,
 					quint32 const msg =   (packet->data[i]) 
 										| (packet->data[i + 1] << 8)
 										| (packet->data[i + 2] << 16);
-					emit midiIn->midiEvent(msg, packet->timeStamp);
+					midiIn->dispatchMessage(msg, packet->timeStamp, timestamp);
 				}
 			}
     	}
@@ -15,6 +15,7 @@
 struct NativeMidiOutInstances {
 	BMidiConsumer* midiOutConsumer;
 	BMidiLocalProducer* midiOutLocProd;
+	bigtime_t scheduleStart;
 };
 
 // TODO: error reporting
@@ -43,6 +44,7 @@ bool QMidiOut::connect(QString outDeviceId)
 	if (fConnected)
 		disconnect();
 	fMidiPtrs = new NativeMidiOutInstances;
+	fMidiPtrs->scheduleStart = 0;
 
 	fMidiPtrs->midiOutConsumer = BMidiRoster::FindConsumer(outDeviceId.toInt());
 	if (fMidiPtrs->midiOutConsumer == NULL) {
@@ -68,6 +70,8 @@ void QMidiOut::disconnect()
 	if (!fConnected)
 		return;
 
+	stopAsync();
+
 	fMidiPtrs->midiOutLocProd->Disconnect(fMidiPtrs->midiOutConsumer);
 	fMidiPtrs->midiOutConsumer->Release();
 	fMidiPtrs->midiOutLocProd->Unregister();
@@ -78,11 +82,9 @@ void QMidiOut::disconnect()
 	fMidiPtrs = NULL;
 }
 
-void QMidiOut::sendMsg(qint32 msg)
+/* time 0 sends right away, later times are delivered by the Midi Kit */
+static void spray_msg(BMidiLocalProducer* producer, qint32 msg, bigtime_t time)
 {
-	if (!fConnected)
-		return;
-
 	uchar command = msg & 0xF0;
 	uchar channel = msg & 0x0F;
 	uchar lsb = (msg >> 8) & 0xFF;
@@ -91,36 +93,33 @@ void QMidiOut::sendMsg(qint32 msg)
 	switch (command)
 	{
 	case 0x80:
-		fMidiPtrs->midiOutLocProd->SprayNoteOff(channel, lsb, msb);
+		producer->SprayNoteOff(channel, lsb, msb, time);
 		break;
 	case 0x90:
-		fMidiPtrs->midiOutLocProd->SprayNoteOn(channel, lsb, msb);
+		producer->SprayNoteOn(channel, lsb, msb, time);
 		break;
 	case 0xA0:
-		fMidiPtrs->midiOutLocProd->SprayKeyPressure(channel, lsb, msb);
+		producer->SprayKeyPressure(channel, lsb, msb, time);
 		break;
 	case 0xB0:
-		fMidiPtrs->midiOutLocProd->SprayControlChange(channel, lsb, msb);
+		producer->SprayControlChange(channel, lsb, msb, time);
 		break;
 	case 0xC0:
-		fMidiPtrs->midiOutLocProd->SprayProgramChange(channel, lsb);
+		producer->SprayProgramChange(channel, lsb, time);
 		break;
 	case 0xD0:
-		fMidiPtrs->midiOutLocProd->SprayChannelPressure(channel, lsb);
+		producer->SprayChannelPressure(channel, lsb, time);
 		break;
 	case 0xE0:
-		fMidiPtrs->midiOutLocProd->SprayPitchBend(channel, lsb, msb);
+		producer->SprayPitchBend(channel, lsb, msb, time);
 		break;
 	default:
 		qWarning("QMidiOut::sendMsg: unknown command %02x", command);
 	}
 }
 
-void QMidiOut::sendSysEx(const QByteArray &data)
+static void spray_sysex(BMidiLocalProducer* producer, const QByteArray &data, bigtime_t time)
 {
-	if (!fConnected)
-		return;
-
 	// SpraySystemExclusive expects the payload without the 0xF0 and 0xF7 markers only
 	if (!(data.front() == '\xF0' && data.back() == '\xF7')) {
 		qWarning("QMidiOut::sendSysEx: invalid SysEx data passed");
@@ -129,7 +128,64 @@ void QMidiOut::sendSysEx(const QByteArray &data)
 	char* payload = const_cast<char*>(data.constData()) + 1;
 	size_t payloadLength = data.length() - 2;
 
-	fMidiPtrs->midiOutLocProd->SpraySystemExclusive(payload, payloadLength);
+	producer->SpraySystemExclusive(payload, payloadLength, time);
+}
+
+void QMidiOut::outputMsg(qint32 msg)
+{
+	if (!fConnected)
+		return;
+
+	spray_msg(fMidiPtrs->midiOutLocProd, msg, 0);
+}
+
+void QMidiOut::sendSysEx(const QByteArray &data)
+{
+	if (!fConnected)
+		return;
+
+	spray_sysex(fMidiPtrs->midiOutLocProd, data, 0);
+}
+
+bool QMidiOut::startSchedule()
+{
+	if (!fConnected)
+		return false;
+
+	fMidiPtrs->scheduleStart = system_time();
+	return true;
+}
+
+void QMidiOut::stopSchedule()
+{
+	/* the Midi Kit has no way to take back sprayed events */
+	if (fConnected)
+		fMidiPtrs->scheduleStart = 0;
+}
+
+void QMidiOut::scheduleMsg(qint32 msg, qint64 nsecs)
+{
+	if (!fConnected)
+		return;
+
+	bigtime_t time = (fMidiPtrs->scheduleStart > 0)
+		? fMidiPtrs->scheduleStart + nsecs / 1000 : 0;
+	spray_msg(fMidiPtrs->midiOutLocProd, msg, time);
+}
+
+void QMidiOut::scheduleSysEx(const QByteArray &data, qint64 nsecs)
+{
+	if (!fConnected)
+		return;
+
+	bigtime_t time = (fMidiPtrs->scheduleStart > 0)
+		? fMidiPtrs->scheduleStart + nsecs / 1000 : 0;
+	spray_sysex(fMidiPtrs->midiOutLocProd, data, time);
+}
+
+/* messages are never buffered here */
+void QMidiOut::flush()
+{
 }
 
 // # pragma mark - QMidiIn
@@ -217,6 +273,12 @@ void QMidiIn::stop()
 	fMidiPtrs->midiInProducer->Disconnect(fMidiPtrs->midiInConsumer);
 }
 
+/* system_time() is what CLOCK_MONOTONIC, and so steady_clock, reads on Haiku */
+static qint64 timestamp_of(bigtime_t time)
+{
+	return (qint64)time * 1000;
+}
+
 QMidiInternal::MidiInConsumer::MidiInConsumer(QMidiIn* midiIn, const char* name)
 	: BMidiLocalConsumer(name), fMidiIn(midiIn)
 {
@@ -227,7 +289,7 @@ void QMidiInternal::MidiInConsumer::ChannelPressure(uchar channel, uchar pressur
 	int data = 0xD0
 			| (channel & 0x0F)
 			| (pressure << 8);
-	emit(fMidiIn->midiEvent(static_cast<quint32>(data), time));
+	fMidiIn->dispatchMessage(static_cast<quint32>(data), time, timestamp_of(time));
 }
 
 void QMidiInternal::MidiInConsumer::ControlChange(uchar channel, uchar controlNumber, uchar controlValue, bigtime_t time)
@@ -236,7 +298,7 @@ void QMidiInternal::MidiInConsumer::ControlChange(uchar channel, uchar controlNu
 			| (channel & 0x0F)
 			| (controlNumber << 8)
 			| (controlValue << 16);
-	emit(fMidiIn->midiEvent(static_cast<quint32>(data), time));
+	fMidiIn->dispatchMessage(static_cast<quint32>(data), time, timestamp_of(time));
 }
 
 void QMidiInternal::MidiInConsumer::KeyPressure(uchar channel, uchar note, uchar pressure, bigtime_t time)
@@ -245,7 +307,7 @@ void QMidiInternal::MidiInConsumer::KeyPressure(uchar channel, uchar note, uchar
 			| (channel & 0x0F)
 			| (note << 8)
 			| (pressure << 16);
-	emit(fMidiIn->midiEvent(static_cast<quint32>(data), time));
+	fMidiIn->dispatchMessage(static_cast<quint32>(data), time, timestamp_of(time));
 }
 
 void QMidiInternal::MidiInConsumer::NoteOff(uchar channel, uchar note, uchar velocity, bigtime_t time)
@@ -254,7 +316,7 @@ void QMidiInternal::MidiInConsumer::NoteOff(uchar channel, uchar note, uchar vel
 			| (channel & 0x0F)
 			| (note << 8)
 			| (velocity << 16);
-	emit(fMidiIn->midiEvent(static_cast<quint32>(data), time));
+	fMidiIn->dispatchMessage(static_cast<quint32>(data), time, timestamp_of(time));
 }
 
 void QMidiInternal::MidiInConsumer::NoteOn(uchar channel, uchar note, uchar velocity, bigtime_t time)
@@ -263,7 +325,7 @@ void QMidiInternal::MidiInConsumer::NoteOn(uchar channel, uchar note, uchar velo
 			| (channel & 0x0F)
 			| (note << 8)
 			| (velocity << 16);
-	emit(fMidiIn->midiEvent(static_cast<quint32>(data), time));
+	fMidiIn->dispatchMessage(static_cast<quint32>(data), time, timestamp_of(time));
 }
 
 void QMidiInternal::MidiInConsumer::PitchBend(uchar channel, uchar lsb, uchar msb, bigtime_t time)
@@ -272,7 +334,7 @@ void QMidiInternal::MidiInConsumer::PitchBend(uchar channel, uchar lsb, uchar ms
 			| (channel & 0x0F)
 			| (lsb << 8)
 			| (msb << 16);
-	emit(fMidiIn->midiEvent(static_cast<quint32>(data), time));
+	fMidiIn->dispatchMessage(static_cast<quint32>(data), time, timestamp_of(time));
 }
 
 void QMidiInternal::MidiInConsumer::ProgramChange(uchar channel, uchar programNumber, bigtime_t time)
@@ -280,13 +342,16 @@ void QMidiInternal::MidiInConsumer::ProgramChange(uchar channel, uchar programNu
 	int data = 0xC0
 			| (channel & 0x0F)
 			| (programNumber << 8);
-	emit(fMidiIn->midiEvent(static_cast<quint32>(data), time));
+	fMidiIn->dispatchMessage(static_cast<quint32>(data), time, timestamp_of(time));
 }
 
 void QMidiInternal::MidiInConsumer::SystemExclusive(void* data, size_t length, bigtime_t time)
 {
-	QByteArray ba = QByteArray(reinterpret_cast<const char*>(data), length);
-	ba.prepend('\xF0');
-	ba.append('\xF7');
-	emit(fMidiIn->midiSysExEvent(ba));
+	/* the Midi Kit strips the start and end bytes; hand them over around the
+	 * data instead of copying it */
+	const char start = '\xF0';
+	const char end = '\xF7';
+	fMidiIn->dispatchSysEx(&start, 1, timestamp_of(time));
+	fMidiIn->dispatchSysEx(reinterpret_cast<const char*>(data), static_cast<int>(length), timestamp_of(time));
+	fMidiIn->dispatchSysEx(&end, 1, timestamp_of(time));
 }
@@ -55,6 +55,8 @@ void QMidiOut::disconnect()
 	if (!fConnected)
 		return;
 
+	stopAsync();
+
 	midiOutClose(fMidiPtrs->midiOut);
 	fConnected = false;
 
@@ -62,7 +64,7 @@ void QMidiOut::disconnect()
 	fMidiPtrs = NULL;
 }
 
-void QMidiOut::sendMsg(qint32 msg)
+void QMidiOut::outputMsg(qint32 msg)
 {
 	if (!fConnected)
 		return;
@@ -89,6 +91,31 @@ void QMidiOut::sendSysEx(const QByteArray &data)
 	while (midiOutUnprepareHeader(fMidiPtrs->midiOut, &header, sizeof(MIDIHDR)) == MIDIERR_STILLPLAYING);
 }
 
+/* midiOutShortMsg() can't be given a time, so messages are sent right away */
+bool QMidiOut::startSchedule()
+{
+	return false;
+}
+
+void QMidiOut::stopSchedule()
+{
+}
+
+void QMidiOut::scheduleMsg(qint32 msg, qint64 /* nsecs */)
+{
+	sendMsg(msg);
+}
+
+void QMidiOut::scheduleSysEx(const QByteArray &data, qint64 /* nsecs */)
+{
+	sendSysEx(data);
+}
+
+/* messages are never buffered here */
+void QMidiOut::flush()
+{
+}
+
 // # pragma mark - QMidiIn
 
 struct NativeMidiInInstances {
@@ -125,13 +152,15 @@ static void CALLBACK QMidiInProc(HMIDIIN hMidiIn, UINT wMsg, DWORD_PTR dwInstanc
 	case MIM_CLOSE:
 		break;
 	case MIM_DATA:
-		emit(self->midiEvent(static_cast<quint32>(dwParam1), static_cast<quint32>(dwParam2)));
+		self->dispatchMessage(static_cast<quint32>(dwParam1), static_cast<quint32>(dwParam2),
+			QMidiIn::timestampNow());
 		break;
 	case MIM_LONGDATA:
 	{
 		auto midiHeader = reinterpret_cast<MIDIHDR*>(dwParam1);
-		auto rawData = QByteArray(midiHeader->lpData, static_cast<int>(midiHeader->dwBytesRecorded));
-		emit(self->midiSysExEvent(rawData));
+		// Messages longer than the buffer arrive in pieces, which QMidiIn puts back together
+		self->dispatchSysEx(midiHeader->lpData, static_cast<int>(midiHeader->dwBytesRecorded),
+			QMidiIn::timestampNow());
 
 		// Prepare the midi header to be reused -- what's the worst that could happen?
 		midiInUnprepareHeader(hMidiIn, midiHeader, sizeof(MIDIHDR));
@@ -4,11 +4,13 @@ CONFIG += c++11
 INCLUDEPATH += $$PWD
 SOURCES += $$PWD/QMidiOut.cpp \
 	$$PWD/QMidiFile.cpp \
-	$$PWD/QMidiIn.cpp
+	$$PWD/QMidiIn.cpp \
+	$$PWD/QMidiPlayer.cpp
 
 HEADERS += $$PWD/QMidiOut.h \
 	$$PWD/QMidiFile.h \
-	$$PWD/QMidiIn.h
+	$$PWD/QMidiIn.h \
+	$$PWD/QMidiPlayer.h
 
 win32 {
 	LIBS += -lwinmm
@@ -6,7 +6,24 @@
 #include "QMidiFile.h"
 
 #include <QFile>
+#include <QHash>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+#include <QVector>
+#include <algorithm>
+#include <climits>
 #include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define QMIDIFILE_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define QMIDIFILE_NEON
+#endif
 
 QMidiEvent::QMidiEvent()
 {
@@ -20,11 +37,39 @@ QMidiEvent::QMidiEvent()
 	fValue = -1;
 	fNumerator = -1;
 	fDenominator = -1;
-	fData = "";
 	fTick = -1;
+	fPooled = false;
+	fRemoved = false;
+}
+QMidiEvent::QMidiEvent(const QMidiEvent& other)
+	: fPooled(false),
+	  fRemoved(false)
+{
+	*this = other;
 }
 QMidiEvent::~QMidiEvent()
 {
+	/* events from a QMidiFile's pool belong to the file; see allocateEvent() */
+	Q_ASSERT(!fPooled);
+}
+
+QMidiEvent& QMidiEvent::operator=(const QMidiEvent& other)
+{
+	/* everything except fPooled and fRemoved, which describe this object's
+	 * allocation and membership in a file */
+	fData = other.fData;
+	fTick = other.fTick;
+	fTrackNumber = other.fTrackNumber;
+	fValue = other.fValue;
+	fNumerator = other.fNumerator;
+	fDenominator = other.fDenominator;
+	fType = other.fType;
+	fVoice = other.fVoice;
+	fNote = other.fNote;
+	fVelocity = other.fVelocity;
+	fAmount = other.fAmount;
+	fNumber = other.fNumber;
+	return *this;
 }
 
 quint32 QMidiEvent::message() const
@@ -166,23 +211,107 @@ float QMidiEvent::tempo()
 
 /* End of QMidiEvent functions, on to QMidiFile */
 
+/* Hands out events from blocks of growing size and frees them all at once,
+ * instead of one new/delete per event. Removed events stay allocated until
+ * the pool is cleared, so pointers to them stay valid until then. */
+struct QMidiEventPool {
+	struct Block {
+		QMidiEvent* events;
+		int count;
+		int capacity;
+	};
+	QVector<Block> blocks;
+
+	QMidiEventPool() {}
+	~QMidiEventPool() { clear(); }
+
+	QMidiEvent* create()
+	{
+		if (blocks.isEmpty() || (blocks.last().count == blocks.last().capacity)) {
+			Block b;
+			b.count = 0;
+			b.capacity = blocks.isEmpty() ? 64 : qMin(blocks.last().capacity * 2, 4096);
+			b.events = static_cast<QMidiEvent*>(::operator new(sizeof(QMidiEvent) * b.capacity));
+			blocks.append(b);
+		}
+		Block& b = blocks.last();
+		QMidiEvent* e = new (b.events + b.count) QMidiEvent();
+		b.count++;
+		e->fPooled = true;
+		return e;
+	}
+
+	/* gives back the most recently created event, if it went unused */
+	void destroyLast()
+	{
+		Block& b = blocks.last();
+		b.count--;
+		b.events[b.count].fPooled = false;
+		b.events[b.count].~QMidiEvent();
+	}
+
+	/* takes over all of other's events */
+	void takeBlocks(QMidiEventPool* other)
+	{
+		blocks += other->blocks;
+		other->blocks.clear();
+	}
+
+	void clear()
+	{
+		for (const Block& b : blocks) {
+			for (int i = 0; i < b.count; i++) {
+				b.events[i].fPooled = false;
+				b.events[i].~QMidiEvent();
+			}
+			::operator delete(b.events);
+		}
+		blocks.clear();
+	}
+};
+
 QMidiFile::QMidiFile()
-	: fDisableSort(false)
+	: fPool(new QMidiEventPool),
+	  fIndexValid(true),
+	  fTempoMapValid(false),
+	  fNotesValid(false),
+	  fParallelTracks(false),
+	  fRunningStatus(false),
+	  fRunningStatusSavings(0),
+	  fRemovedCount(0),
+	  fBatchDepth(0),
+	  fBatchStart(0),
+	  fTempoBatchStart(0),
+	  fBatchNeedsFullSort(false)
 {
 	clear();
 }
 QMidiFile::~QMidiFile()
 {
 	clear();
+	delete fPool;
 }
 
 void QMidiFile::clear()
 {
-	for (QMidiEvent* e : fEvents)
-		delete e;
+	/* only pooled events are ever left marked as removed */
+	for (QMidiEvent* e : fEvents) {
+		if (!e->fPooled)
+			delete e;
+	}
+	fPool->clear();
 	fEvents.clear();
 	fTempoEvents.clear();
 	fTracks.clear();
+	fTrackIndex.clear();
+	fVoiceIndex.clear();
+	fFilteredIndex.clear();
+	fIndexValid = true;
+	fTempoMapValid = false;
+	fNotesValid = false;
+	fRemovedCount = 0;
+	fBatchStart = 0;
+	fTempoBatchStart = 0;
 	fDivType = PPQ;
 	fResolution = 0;
 	fFileFormat = 1;
@@ -199,32 +328,37 @@ QMidiFile* QMidiFile::oneTrackPerVoice()
 	ret->setResolution(fResolution);
 	ret->setFileFormat(1);
 
+	compact();
 	QMap<int /*voice*/, int /*track*/> tracks;
 	ret->createTrack(); /* Track 0 */
-	ret->fDisableSort = true;
+	/* fEvents is sorted, so each new track's events come out in order too */
+	QVector<QList<QMidiEvent*> > runs(2);
 	for (QMidiEvent* event : fEvents) {
-		QMidiEvent* e = new QMidiEvent();
+		QMidiEvent* e = ret->allocateEvent();
 		*e = *event; /* copy data buffer */
 		if ((e->type() == QMidiEvent::Meta) && (e->number() == QMidiEvent::TrackName)) {
 			e->setTrack(1);
-			ret->addEvent(e->tick(), e);
-			continue;
 		} else if (e->type() == QMidiEvent::Meta) {
 			e->setTrack(0);
-			ret->addEvent(e->tick(), e);
-			continue;
-		}
-		if (!tracks.contains(e->voice())) {
-			tracks.insert(e->voice(), ret->createTrack());
+		} else {
+			if (!tracks.contains(e->voice())) {
+				tracks.insert(e->voice(), ret->createTrack());
+				runs.resize(ret->fTracks.size());
+			}
+			e->setTrack(tracks.value(e->voice()));
 		}
-		e->setTrack(tracks.value(e->voice()));
-		ret->addEvent(e->tick(), e);
+		runs[e->track()].append(e);
 	}
-	ret->fDisableSort = false;
-	ret->sort();
+	ret->setEventsFromRuns(runs);
 	return ret;
 }
 
+static inline bool isTempoEvent(QMidiEvent* e)
+{
+	return (e->track() == 0) && (e->type() == QMidiEvent::Meta) &&
+		   (e->number() == QMidiEvent::Tempo);
+}
+
 bool isGreaterThan(QMidiEvent* e1, QMidiEvent* e2)
 {
 	qint32 e1t = e1->tick();
@@ -233,47 +367,522 @@ bool isGreaterThan(QMidiEvent* e1, QMidiEvent* e2)
 }
 void QMidiFile::sort()
 {
-	if (fDisableSort) {
+	if (fBatchDepth > 0) {
+		/* ticks may have been changed anywhere, so the commit can't just merge */
+		fBatchNeedsFullSort = true;
 		return;
 	}
+	compact();
 	std::stable_sort(fEvents.begin(), fEvents.end(), isGreaterThan);
 	std::stable_sort(fTempoEvents.begin(), fTempoEvents.end(), isGreaterThan);
+	fIndexValid = false;
+	fTempoMapValid = false;
+	fNotesValid = false;
+}
+
+/* Inserts e into a list sorted by tick, after any events with the same tick
+ * (where a stable sort would have put it). */
+static void insert_sorted(QList<QMidiEvent*>& list, QMidiEvent* e)
+{
+	list.insert(std::upper_bound(list.begin(), list.end(), e, isGreaterThan), e);
+}
+
+/* Finds e in a list sorted by tick, by binary search on its tick. Falls back to
+ * a linear search in case the tick was changed without calling sort(). */
+static int find_sorted(const QList<QMidiEvent*>& list, QMidiEvent* e)
+{
+	QList<QMidiEvent*>::const_iterator it =
+		std::lower_bound(list.constBegin(), list.constEnd(), e, isGreaterThan);
+	for (; (it != list.constEnd()) && ((*it)->tick() == e->tick()); ++it) {
+		if (*it == e)
+			return it - list.constBegin();
+	}
+	return list.indexOf(e);
+}
+
+static void mergeAppended(QList<QMidiEvent*>& list, int sortedCount)
+{
+	/* the first sortedCount events are already in order; sort the rest and
+	 * merge them in. Both steps are stable, so ties keep insertion order. */
+	if (sortedCount >= list.size()) {
+		return;
+	}
+	QList<QMidiEvent*>::iterator middle = list.begin() + sortedCount;
+	std::stable_sort(middle, list.end(), isGreaterThan);
+	std::inplace_merge(list.begin(), middle, list.end(), isGreaterThan);
+}
+
+/* Head of one run in merge_runs()'s heap. */
+struct RunHead {
+	qint32 tick;
+	int run;
+	int index;
+};
+static inline bool runHeadAfter(const RunHead& a, const RunHead& b)
+{
+	return (a.tick > b.tick) || ((a.tick == b.tick) && (a.run > b.run));
+}
+
+/* k-way merge of runs that are each in tick order, in O(N log k). Ties go to
+ * the earlier run, giving the same order as a stable sort of the runs
+ * concatenated. */
+static void merge_runs(const QVector<QList<QMidiEvent*> >& runs, QList<QMidiEvent*>* out)
+{
+	QVector<RunHead> heap;
+	int total = 0;
+	for (int i = 0; i < runs.size(); i++) {
+		total += runs.at(i).size();
+		if (!runs.at(i).isEmpty()) {
+			RunHead h = { runs.at(i).first()->tick(), i, 0 };
+			heap.append(h);
+		}
+	}
+	out->reserve(out->size() + total);
+	std::make_heap(heap.begin(), heap.end(), runHeadAfter);
+
+	while (heap.size() > 1) {
+		std::pop_heap(heap.begin(), heap.end(), runHeadAfter);
+		RunHead& h = heap.last();
+		const QList<QMidiEvent*>& run = runs.at(h.run);
+		out->append(run.at(h.index));
+		if (++h.index < run.size()) {
+			h.tick = run.at(h.index)->tick();
+			std::push_heap(heap.begin(), heap.end(), runHeadAfter);
+		} else {
+			heap.removeLast();
+		}
+	}
+	if (!heap.isEmpty()) {
+		const QList<QMidiEvent*>& run = runs.at(heap.first().run);
+		for (int i = heap.first().index; i < run.size(); i++)
+			out->append(run.at(i));
+	}
+}
+
+void QMidiFile::setEventsFromRuns(const QVector<QList<QMidiEvent*> >& runs)
+{
+	/* only used on a file without events, with one run per track, so the
+	 * result is fully sorted and the runs are the track index */
+	merge_runs(runs, &fEvents);
+	for (QMidiEvent* e : fEvents) {
+		if (isTempoEvent(e))
+			fTempoEvents.append(e);
+		fVoiceIndex[e->voice()].append(e);
+	}
+	for (int track = 0; track < runs.size(); track++) {
+		if (!runs.at(track).isEmpty())
+			fTrackIndex.insert(track, runs.at(track));
+	}
+	fFilteredIndex.clear();
+	fIndexValid = true;
+	fTempoMapValid = false;
+	fNotesValid = false;
+	fBatchStart = fEvents.size();
+	fTempoBatchStart = fTempoEvents.size();
+}
+
+void QMidiFile::updateIndex()
+{
+	compact();
+	if (fIndexValid) {
+		return;
+	}
+	fTrackIndex.clear();
+	fVoiceIndex.clear();
+	fFilteredIndex.clear();
+	QList<QMidiEvent*>* track = 0;
+	QList<QMidiEvent*>* voice = 0;
+	int trackNumber = 0;
+	int voiceNumber = 0;
+	/* events added in an unfinished batch aren't sorted yet, so they are left
+	 * out until commitBatch() */
+	const int sorted = (fBatchDepth > 0) ? fBatchStart : fEvents.size();
+	for (int i = 0; i < sorted; i++) {
+		QMidiEvent* e = fEvents.at(i);
+		if (!track || (e->track() != trackNumber)) {
+			trackNumber = e->track();
+			track = &fTrackIndex[trackNumber];
+		}
+		track->append(e);
+		if (!voice || (e->voice() != voiceNumber)) {
+			voiceNumber = e->voice();
+			voice = &fVoiceIndex[voiceNumber];
+		}
+		voice->append(e);
+	}
+	fIndexValid = true;
+}
+
+void QMidiFile::beginBatch()
+{
+	if (fBatchDepth++ > 0) {
+		return;
+	}
+	fBatchStart = fEvents.size();
+	fTempoBatchStart = fTempoEvents.size();
+	fBatchNeedsFullSort = false;
+}
+
+void QMidiFile::commitBatch()
+{
+	if ((fBatchDepth == 0) || (--fBatchDepth > 0)) {
+		return;
+	}
+	compact();
+	if (fBatchNeedsFullSort) {
+		fBatchNeedsFullSort = false;
+		sort();
+	} else {
+		mergeAppended(fEvents, fBatchStart);
+		mergeAppended(fTempoEvents, fTempoBatchStart);
+		fTempoMapValid = false;
+	}
+	/* the index and notes may have been built during the batch, without its
+	 * events */
+	fIndexValid = false;
+	fNotesValid = false;
+	fBatchStart = fEvents.size();
+	fTempoBatchStart = fTempoEvents.size();
+}
+
+QMidiEvent* QMidiFile::allocateEvent()
+{
+	return fPool->create();
 }
 
 void QMidiFile::addEvent(qint32 tick, QMidiEvent* e)
 {
+	if (e->fRemoved) {
+		/* re-adding a removed event; drop its old place first if compact()
+		 * hasn't yet */
+		e->fRemoved = false;
+		if (takeOut(e))
+			fRemovedCount--;
+	}
 	e->setTick(tick);
-	fEvents.append(e);
-	if ((e->track() == 0) && (e->type() == QMidiEvent::Meta) && (e->number() == QMidiEvent::Tempo)) {
-		fTempoEvents.append(e);
+	if (fBatchDepth > 0) {
+		fEvents.append(e);
+		if (isTempoEvent(e)) {
+			fTempoEvents.append(e);
+			fTempoMapValid = false;
+		}
+		fIndexValid = false;
+		fNotesValid = false;
+		return;
+	}
+
+	insert_sorted(fEvents, e);
+	if (isTempoEvent(e)) {
+		insert_sorted(fTempoEvents, e);
+		fTempoMapValid = false;
+	}
+	if (fIndexValid) {
+		insert_sorted(fTrackIndex[e->track()], e);
+		insert_sorted(fVoiceIndex[e->voice()], e);
+		fFilteredIndex.clear();
+	}
+	if (e->isNoteEvent()) {
+		fNotesValid = false;
+	}
+}
+/* Removes e from the lists right away, like the single removeEvent() always
+ * did; O(n). */
+bool QMidiFile::takeOut(QMidiEvent* e)
+{
+	int i = find_sorted(fEvents, e);
+	if (i < 0) {
+		return false;
+	}
+	fEvents.removeAt(i);
+	if (i < fBatchStart) {
+		fBatchStart--;
+	}
+	if (isTempoEvent(e)) {
+		i = find_sorted(fTempoEvents, e);
+		if (i >= 0) {
+			fTempoEvents.removeAt(i);
+			if (i < fTempoBatchStart)
+				fTempoBatchStart--;
+		}
+		fTempoMapValid = false;
+	}
+	if (fIndexValid) {
+		QList<QMidiEvent*>& track = fTrackIndex[e->track()];
+		QList<QMidiEvent*>& voice = fVoiceIndex[e->voice()];
+		const int track_pos = find_sorted(track, e);
+		const int voice_pos = find_sorted(voice, e);
+		if ((track_pos < 0) || (voice_pos < 0)) {
+			fIndexValid = false; /* e changed track or voice while in the file */
+		} else {
+			track.removeAt(track_pos);
+			voice.removeAt(voice_pos);
+			fFilteredIndex.clear();
+		}
+	}
+	if (e->isNoteEvent()) {
+		fNotesValid = false;
+	}
+	return true;
+}
+
+/* Removed events are only marked, which needs no shifting of the lists; they
+ * are dropped from all of them in one pass by compact(), which every function
+ * reading the lists calls first. */
+bool QMidiFile::markRemoved(QMidiEvent* e)
+{
+	if (e->fRemoved || (find_sorted(fEvents, e) < 0)) {
+		return false;
+	}
+	e->fRemoved = true;
+	fRemovedCount++;
+	if (isTempoEvent(e)) {
+		fTempoMapValid = false;
 	}
-	sort();
+	if (e->isNoteEvent()) {
+		fNotesValid = false;
+	}
+	return true;
 }
+
 void QMidiFile::removeEvent(QMidiEvent* e)
 {
-	fEvents.removeOne(e);
-	if ((e->track() == 0) && (e->type() == QMidiEvent::Meta) && (e->number() == QMidiEvent::Tempo)) {
-		fTempoEvents.removeOne(e);
+	if (e->fRemoved) {
+		return;
 	}
+	if (!e->fPooled) {
+		/* the caller owns the event again and may delete it right away */
+		takeOut(e);
+		return;
+	}
+	markRemoved(e);
+}
+
+void QMidiFile::removeEvents(const QList<QMidiEvent*>& events)
+{
+	for (QMidiEvent* e : events) {
+		markRemoved(e);
+	}
+	compact();
+}
+
+void QMidiFile::removeEvents(qint32 start_tick, qint32 end_tick)
+{
+	compact();
+	/* events added in an unfinished batch aren't sorted yet */
+	int sorted = (fBatchDepth > 0) ? fBatchStart : fEvents.size();
+	QList<QMidiEvent*>::iterator it = std::lower_bound(
+		fEvents.begin(), fEvents.begin() + sorted, start_tick,
+		[](QMidiEvent* e, qint32 tick) { return e->tick() < tick; });
+	for (; (it != fEvents.begin() + sorted) && ((*it)->tick() < end_tick); ++it) {
+		markRemoved(*it);
+	}
+	for (int i = sorted; i < fEvents.size(); i++) {
+		QMidiEvent* e = fEvents.at(i);
+		if ((e->tick() >= start_tick) && (e->tick() < end_tick))
+			markRemoved(e);
+	}
+	compact();
+}
+
+void QMidiFile::removeEvents(std::function<bool(QMidiEvent*)> predicate)
+{
+	compact();
+	for (QMidiEvent* e : fEvents) {
+		if (predicate(e))
+			markRemoved(e);
+	}
+	compact();
+}
+
+void QMidiFile::compact()
+{
+	if (fRemovedCount == 0) {
+		return;
+	}
+	/* drops marked events from list, and returns how many of them were among
+	 * the first prefix entries; with release, events allocated with new are
+	 * handed back to the caller, while pooled ones stay marked until clear()
+	 * so that addEvent() can tell they are no longer in the lists */
+	auto remove_marked = [](QList<QMidiEvent*>& list, int prefix, bool release) {
+		int dropped_before_prefix = 0;
+		int out = 0;
+		for (int i = 0; i < list.size(); i++) {
+			QMidiEvent* e = list.at(i);
+			if (!e->fRemoved) {
+				list[out++] = e;
+				continue;
+			}
+			if (i < prefix)
+				dropped_before_prefix++;
+			if (release && !e->fPooled)
+				e->fRemoved = false;
+		}
+		list.erase(list.begin() + out, list.end());
+		return dropped_before_prefix;
+	};
+	fTempoBatchStart -= remove_marked(fTempoEvents, fTempoBatchStart, false);
+	fBatchStart -= remove_marked(fEvents, fBatchStart, true);
+	fRemovedCount = 0;
+	fIndexValid = false;
 }
 
 QList<QMidiEvent*> QMidiFile::eventsForTrack(int track)
 {
+	updateIndex();
+	return fTrackIndex.value(track);
+}
+
+QList<QMidiEvent*> QMidiFile::events(int voice)
+{
+	updateIndex();
+	return fVoiceIndex.value(voice);
+}
+
+QList<QMidiEvent*> QMidiFile::events(int voice, QMidiEvent::EventType type, int number)
+{
+	updateIndex();
+	/* numbers past 127 match no event, just like 128 */
+	const quint64 key = ((quint64)(quint32)voice << 32) | ((quint64)(type & 0xffff) << 16) |
+						(quint16)qBound(-1, number, 128);
+	QHash<quint64, QList<QMidiEvent*> >::const_iterator cached = fFilteredIndex.constFind(key);
+	if (cached != fFilteredIndex.constEnd()) {
+		return cached.value();
+	}
+
 	QList<QMidiEvent*> ret;
-	for (QMidiEvent* e : fEvents) {
-		if (e->track() == track) {
-			ret.append(e);
+	QMap<int, QList<QMidiEvent*> >::const_iterator it = fVoiceIndex.constFind(voice);
+	if (it != fVoiceIndex.constEnd()) {
+		for (QMidiEvent* e : it.value()) {
+			if ((e->type() == type) && ((number < 0) || (e->number() == number))) {
+				ret.append(e);
+			}
 		}
 	}
+	fFilteredIndex.insert(key, ret);
 	return ret;
 }
 
-QList<QMidiEvent*> QMidiFile::events(int voice)
+/* the events of the sorted list [begin, end) in a tick range */
+static QMidiEventRange range_of(QList<QMidiEvent*>::const_iterator begin,
+								QList<QMidiEvent*>::const_iterator end, qint32 start_tick,
+								qint32 end_tick, QMidiEvent::EventType type)
 {
-	QList<QMidiEvent*> ret;
-	for (QMidiEvent* e : fEvents) {
-		if (e->voice() == voice) {
-			ret.append(e);
+	auto tick_less = [](QMidiEvent* e, qint32 tick) { return e->tick() < tick; };
+	QList<QMidiEvent*>::const_iterator first = std::lower_bound(begin, end, start_tick, tick_less);
+	QList<QMidiEvent*>::const_iterator last = first;
+	if (end_tick > start_tick) {
+		last = std::lower_bound(first, end, end_tick, tick_less);
+	}
+	return QMidiEventRange(first, last, type);
+}
+
+QMidiEventRange QMidiFile::eventsInRange(qint32 start_tick, qint32 end_tick,
+										 QMidiEvent::EventType type)
+{
+	compact();
+	int sorted = (fBatchDepth > 0) ? fBatchStart : fEvents.size();
+	return range_of(fEvents.constBegin(), fEvents.constBegin() + sorted, start_tick, end_tick,
+					type);
+}
+
+QMidiEventRange QMidiFile::eventsInRangeForTrack(int track, qint32 start_tick, qint32 end_tick,
+												 QMidiEvent::EventType type)
+{
+	updateIndex();
+	QMap<int, QList<QMidiEvent*> >::const_iterator it = fTrackIndex.constFind(track);
+	if (it == fTrackIndex.constEnd()) {
+		return QMidiEventRange(fEvents.constEnd(), fEvents.constEnd());
+	}
+	return range_of(it.value().constBegin(), it.value().constEnd(), start_tick, end_tick, type);
+}
+
+QMidiEventRange QMidiFile::eventsInRangeForVoice(int voice, qint32 start_tick, qint32 end_tick,
+												 QMidiEvent::EventType type)
+{
+	updateIndex();
+	QMap<int, QList<QMidiEvent*> >::const_iterator it = fVoiceIndex.constFind(voice);
+	if (it == fVoiceIndex.constEnd()) {
+		return QMidiEventRange(fEvents.constEnd(), fEvents.constEnd());
+	}
+	return range_of(it.value().constBegin(), it.value().constEnd(), start_tick, end_tick, type);
+}
+
+/* Pairs each NoteOn with the first still sounding NoteOn of the same track,
+ * voice and note when its NoteOff comes (a NoteOn with velocity 0 counts as a
+ * NoteOff), so notes come out sorted by start tick. Notes never turned off end
+ * with their track. */
+void QMidiFile::updateNotes()
+{
+	compact();
+	if (fNotesValid) {
+		return;
+	}
+	fNotes.clear();
+	fMaxNoteLength = 0;
+	QHash<quint64, QList<int> > sounding;
+	/* events added in an unfinished batch aren't sorted yet, so they are left
+	 * out until commitBatch() */
+	const int sorted = (fBatchDepth > 0) ? fBatchStart : fEvents.size();
+	for (int i = 0; i < sorted; i++) {
+		QMidiEvent* e = fEvents.at(i);
+		if (!e->isNoteEvent()) {
+			continue;
+		}
+		quint64 key = ((quint64)(quint32)e->track() << 16) | ((e->voice() & 0xff) << 8) |
+					  (e->note() & 0xff);
+		if ((e->type() == QMidiEvent::NoteOn) && (e->velocity() > 0)) {
+			QMidiNote note;
+			note.startTick = e->tick();
+			note.endTick = -1;
+			note.track = e->track();
+			note.voice = e->voice();
+			note.note = e->note();
+			note.velocity = e->velocity();
+			note.offVelocity = -1;
+			note.noteOn = e;
+			note.noteOff = 0;
+			sounding[key].append(fNotes.size());
+			fNotes.append(note);
+			continue;
+		}
+		QHash<quint64, QList<int> >::iterator it = sounding.find(key);
+		if ((it == sounding.end()) || it.value().isEmpty()) {
+			continue;
+		}
+		QMidiNote& note = fNotes[it.value().takeFirst()];
+		note.endTick = e->tick();
+		note.offVelocity = (e->type() == QMidiEvent::NoteOff) ? e->velocity() : 64;
+		note.noteOff = e;
+	}
+	for (QMidiNote& note : fNotes) {
+		if (note.endTick < 0) {
+			note.endTick = trackEndTick(note.track);
+		}
+		fMaxNoteLength = qMax(fMaxNoteLength, (qint64)note.endTick - note.startTick);
+	}
+	fNotesValid = true;
+}
+
+QVector<QMidiNote> QMidiFile::notes()
+{
+	updateNotes();
+	return fNotes;
+}
+
+QVector<QMidiNote> QMidiFile::notesInRange(qint32 start_tick, qint32 end_tick, int low_note,
+										   int high_note)
+{
+	updateNotes();
+	QVector<QMidiNote> ret;
+	/* no note starting before start_tick - fMaxNoteLength can still sound */
+	const qint64 first_start = (qint64)start_tick - fMaxNoteLength;
+	QVector<QMidiNote>::const_iterator it = std::lower_bound(
+		fNotes.constBegin(), fNotes.constEnd(), first_start,
+		[](const QMidiNote& note, qint64 tick) { return note.startTick < tick; });
+	for (; (it != fNotes.constEnd()) && (it->startTick < end_tick); ++it) {
+		if (((it->endTick > start_tick) || (it->startTick >= start_tick)) &&
+			(it->note >= low_note) && (it->note <= high_note)) {
+			ret.append(*it);
 		}
 	}
 	return ret;
@@ -295,13 +904,12 @@ void QMidiFile::removeTrack(int track)
 
 qint32 QMidiFile::trackEndTick(int track)
 {
-	for (int i = fEvents.size() - 1; i >= 0; i--) {
-		QMidiEvent* e = fEvents.at(i);
-		if (e->track() == track) {
-			return e->tick();
-		}
+	updateIndex();
+	QMap<int, QList<QMidiEvent*> >::const_iterator it = fTrackIndex.constFind(track);
+	if ((it == fTrackIndex.constEnd()) || it.value().isEmpty()) {
+		return 0;
 	}
-	return 0;
+	return it.value().last()->tick();
 }
 
 QMidiEvent* QMidiFile::createNote(int track, qint32 start_tick, qint32 end_tick, int voice,
@@ -313,7 +921,7 @@ QMidiEvent* QMidiFile::createNote(int track, qint32 start_tick, qint32 end_tick,
 
 QMidiEvent* QMidiFile::createNoteOffEvent(int track, qint32 tick, int voice, int note, int velocity)
 {
-	QMidiEvent* e = new QMidiEvent();
+	QMidiEvent* e = allocateEvent();
 	e->setType(QMidiEvent::NoteOff);
 	e->setTrack(track);
 	e->setVoice(voice);
@@ -324,7 +932,7 @@ QMidiEvent* QMidiFile::createNoteOffEvent(int track, qint32 tick, int voice, int
 }
 QMidiEvent* QMidiFile::createNoteOnEvent(int track, qint32 tick, int voice, int note, int velocity)
 {
-	QMidiEvent* e = new QMidiEvent();
+	QMidiEvent* e = allocateEvent();
 	e->setType(QMidiEvent::NoteOn);
 	e->setTrack(track);
 	e->setVoice(voice);
@@ -336,7 +944,7 @@ QMidiEvent* QMidiFile::createNoteOnEvent(int track, qint32 tick, int voice, int
 QMidiEvent* QMidiFile::createKeyPressureEvent(int track, qint32 tick, int voice, int note,
 											  int amount)
 {
-	QMidiEvent* e = new QMidiEvent();
+	QMidiEvent* e = allocateEvent();
 	e->setType(QMidiEvent::KeyPressure);
 	e->setTrack(track);
 	e->setVoice(voice);
@@ -347,7 +955,7 @@ QMidiEvent* QMidiFile::createKeyPressureEvent(int track, qint32 tick, int voice,
 }
 QMidiEvent* QMidiFile::createChannelPressureEvent(int track, qint32 tick, int voice, int amount)
 {
-	QMidiEvent* e = new QMidiEvent();
+	QMidiEvent* e = allocateEvent();
 	e->setType(QMidiEvent::ChannelPressure);
 	e->setTrack(track);
 	e->setVoice(voice);
@@ -358,7 +966,7 @@ QMidiEvent* QMidiFile::createChannelPressureEvent(int track, qint32 tick, int vo
 QMidiEvent* QMidiFile::createControlChangeEvent(int track, qint32 tick, int voice, int number,
 												int value)
 {
-	QMidiEvent* e = new QMidiEvent();
+	QMidiEvent* e = allocateEvent();
 	e->setType(QMidiEvent::ControlChange);
 	e->setTrack(track);
 	e->setVoice(voice);
@@ -369,7 +977,7 @@ QMidiEvent* QMidiFile::createControlChangeEvent(int track, qint32 tick, int voic
 }
 QMidiEvent* QMidiFile::createProgramChangeEvent(int track, qint32 tick, int voice, int number)
 {
-	QMidiEvent* e = new QMidiEvent();
+	QMidiEvent* e = allocateEvent();
 	e->setType(QMidiEvent::ProgramChange);
 	e->setTrack(track);
 	e->setVoice(voice);
@@ -379,7 +987,7 @@ QMidiEvent* QMidiFile::createProgramChangeEvent(int track, qint32 tick, int voic
 }
 QMidiEvent* QMidiFile::createPitchWheelEvent(int track, qint32 tick, int voice, int value)
 {
-	QMidiEvent* e = new QMidiEvent();
+	QMidiEvent* e = allocateEvent();
 	e->setType(QMidiEvent::PitchWheel);
 	e->setTrack(track);
 	e->setVoice(voice);
@@ -389,7 +997,7 @@ QMidiEvent* QMidiFile::createPitchWheelEvent(int track, qint32 tick, int voice,
 }
 QMidiEvent* QMidiFile::createSysexEvent(int track, qint32 tick, QByteArray data)
 {
-	QMidiEvent* e = new QMidiEvent();
+	QMidiEvent* e = allocateEvent();
 	e->setType(QMidiEvent::SysEx);
 	e->setTrack(track);
 	e->setData(data);
@@ -398,7 +1006,7 @@ QMidiEvent* QMidiFile::createSysexEvent(int track, qint32 tick, QByteArray data)
 }
 QMidiEvent* QMidiFile::createMetaEvent(int track, qint32 tick, int number, QByteArray data)
 {
-	QMidiEvent* e = new QMidiEvent();
+	QMidiEvent* e = allocateEvent();
 	e->setType(QMidiEvent::Meta);
 	e->setTrack(track);
 	e->setNumber(number);
@@ -418,7 +1026,7 @@ QMidiEvent* QMidiFile::createTempoEvent(int track, qint32 tick, float tempo)
 QMidiEvent* QMidiFile::createTimeSignatureEvent(int track, qint32 tick, int numerator,
 												int denominator)
 {
-	QMidiEvent* e = new QMidiEvent();
+	QMidiEvent* e = allocateEvent();
 	e->setType(QMidiEvent::Meta);
 	e->setNumber(QMidiEvent::TimeSignature);
 	e->setTrack(track);
@@ -429,7 +1037,7 @@ QMidiEvent* QMidiFile::createTimeSignatureEvent(int track, qint32 tick, int nume
 }
 QMidiEvent* QMidiFile::createLyricEvent(int track, qint32 tick, QByteArray text)
 {
-	QMidiEvent* e = new QMidiEvent();
+	QMidiEvent* e = allocateEvent();
 	e->setType(QMidiEvent::Meta);
 	e->setNumber(QMidiEvent::Lyric);
 	e->setTrack(track);
@@ -439,7 +1047,7 @@ QMidiEvent* QMidiFile::createLyricEvent(int track, qint32 tick, QByteArray text)
 }
 QMidiEvent* QMidiFile::createMarkerEvent(int track, qint32 tick, QByteArray text)
 {
-	QMidiEvent* e = new QMidiEvent();
+	QMidiEvent* e = allocateEvent();
 	e->setType(QMidiEvent::Meta);
 	e->setNumber(QMidiEvent::Marker);
 	e->setTrack(track);
@@ -449,67 +1057,88 @@ QMidiEvent* QMidiFile::createMarkerEvent(int track, qint32 tick, QByteArray text
 }
 QMidiEvent* QMidiFile::createVoiceEvent(int track, qint32 tick, quint32 data)
 {
-	QMidiEvent* e = new QMidiEvent();
+	QMidiEvent* e = allocateEvent();
 	e->setTrack(track);
 	e->setMessage(data);
 	addEvent(tick, e);
 	return e;
 }
 
-float QMidiFile::timeFromTick(qint32 tick)
+/* Each tempo segment records the sum of ticks times microseconds per quarter
+ * note up to its start. Dividing that by the resolution gives microseconds, so
+ * the map stays exact and doesn't depend on the resolution. */
+void QMidiFile::updateTempoMap()
+{
+	compact();
+	if (fTempoMapValid) {
+		return;
+	}
+	fTempoMap.clear();
+	TempoSegment segment;
+	segment.tick = 0;
+	segment.scaledTime = 0;
+	segment.microsPerQuarter = 500000; /* 120 BPM until the first tempo event */
+	fTempoMap.append(segment);
+	for (QMidiEvent* e : fTempoEvents) {
+		const QByteArray data = e->data();
+		if (data.size() < 3) {
+			continue;
+		}
+		const unsigned char* buffer = (const unsigned char*)data.constData();
+		qint32 micros_per_quarter = (buffer[0] << 16) | (buffer[1] << 8) | buffer[2];
+		if (micros_per_quarter == 0) {
+			continue;
+		}
+		segment.scaledTime +=
+			(qint64)(e->tick() - segment.tick) * segment.microsPerQuarter;
+		segment.tick = e->tick();
+		segment.microsPerQuarter = micros_per_quarter;
+		fTempoMap.append(segment);
+	}
+	fTempoMapValid = true;
+}
+
+double QMidiFile::timeFromTick(qint32 tick)
 {
 	switch (fDivType) {
 	case PPQ: {
-		float tempo_event_time = 0.0;
-		qint32 tempo_event_tick = 0;
-		float tempo = 120.0;
-
-		for (QMidiEvent* e : fTempoEvents) {
-			if (e->tick() >= tick) {
-				break;
-			}
-			tempo_event_time +=
-				(((float)(e->tick() - tempo_event_tick)) / fResolution / (tempo / 60));
-			tempo_event_tick = e->tick();
-			tempo = e->tempo();
+		updateTempoMap();
+		QVector<TempoSegment>::const_iterator it =
+			std::upper_bound(fTempoMap.constBegin(), fTempoMap.constEnd(), tick,
+							 [](qint32 t, const TempoSegment& s) { return t < s.tick; });
+		if (it != fTempoMap.constBegin()) {
+			--it;
 		}
-
-		float time =
-			tempo_event_time + (((float)(tick - tempo_event_tick)) / fResolution / (tempo / 60));
-		return time;
+		qint64 scaled_time =
+			it->scaledTime + (qint64)(tick - it->tick) * it->microsPerQuarter;
+		return scaled_time / (fResolution * 1000000.0);
 	}
 	case SMPTE24:
-		return (float)(tick) / (fResolution * 24.0);
+		return (double)(tick) / (fResolution * 24.0);
 	case SMPTE25:
-		return (float)(tick) / (fResolution * 25.0);
+		return (double)(tick) / (fResolution * 25.0);
 	case SMPTE30DROP:
-		return (float)(tick) / (fResolution * 29.97);
+		return (double)(tick) / (fResolution * 29.97);
 	case SMPTE30:
-		return (float)(tick) / (fResolution * 30.0);
+		return (double)(tick) / (fResolution * 30.0);
 	default:
 		return -1;
 	}
 }
 
-qint32 QMidiFile::tickFromTime(float time)
+qint32 QMidiFile::tickFromTime(double time)
 {
 	switch (fDivType) {
 	case PPQ: {
-		float tempo_event_time = 0.0;
-		qint32 tempo_event_tick = 0;
-		float tempo = 120.0;
-
-		for (QMidiEvent* e : fTempoEvents) {
-			float next_tempo_event_time =
-				tempo_event_time +
-				(((float)(e->tick() - tempo_event_tick)) / fResolution / (tempo / 60));
-			if (next_tempo_event_time >= time) break;
-			tempo_event_time = next_tempo_event_time;
-			tempo_event_tick = e->tick();
-			tempo = e->tempo();
+		updateTempoMap();
+		double scaled_time = time * fResolution * 1000000.0;
+		QVector<TempoSegment>::const_iterator it =
+			std::upper_bound(fTempoMap.constBegin(), fTempoMap.constEnd(), scaled_time,
+							 [](double t, const TempoSegment& s) { return t < s.scaledTime; });
+		if (it != fTempoMap.constBegin()) {
+			--it;
 		}
-
-		return tempo_event_tick + (qint32)((time - tempo_event_time) * (tempo / 60) * fResolution);
+		return it->tick + (qint32)((scaled_time - it->scaledTime) / it->microsPerQuarter);
 	}
 	case SMPTE24:
 		return (qint32)(time * fResolution * 24.0);
@@ -524,6 +1153,120 @@ qint32 QMidiFile::tickFromTime(float time)
 	}
 }
 
+/* times[i] = offset + ticks[i] * scale. Compilers only vectorize the plain
+ * loop at -O3, so the SIMD versions are spelled out for four ticks at a time;
+ * the rest go through the scalar loop, which the compiler may contract into a
+ * fused multiply-add, so results can differ in the last bit between paths. */
+static void scale_ticks(const qint32* ticks, double* times, int count, double offset,
+						double scale)
+{
+	int i = 0;
+#if defined(QMIDIFILE_SSE2)
+	const __m128d offset2 = _mm_set1_pd(offset);
+	const __m128d scale2 = _mm_set1_pd(scale);
+	for (; i + 4 <= count; i += 4) {
+		__m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ticks + i));
+		__m128d lo = _mm_cvtepi32_pd(t);
+		__m128d hi = _mm_cvtepi32_pd(_mm_srli_si128(t, 8));
+		_mm_storeu_pd(times + i, _mm_add_pd(offset2, _mm_mul_pd(lo, scale2)));
+		_mm_storeu_pd(times + i + 2, _mm_add_pd(offset2, _mm_mul_pd(hi, scale2)));
+	}
+#elif defined(QMIDIFILE_NEON)
+	const float64x2_t offset2 = vdupq_n_f64(offset);
+	const float64x2_t scale2 = vdupq_n_f64(scale);
+	for (; i + 4 <= count; i += 4) {
+		int32x4_t t = vld1q_s32(ticks + i);
+		float64x2_t lo = vcvtq_f64_s64(vmovl_s32(vget_low_s32(t)));
+		float64x2_t hi = vcvtq_f64_s64(vmovl_s32(vget_high_s32(t)));
+		vst1q_f64(times + i, vaddq_f64(offset2, vmulq_f64(lo, scale2)));
+		vst1q_f64(times + i + 2, vaddq_f64(offset2, vmulq_f64(hi, scale2)));
+	}
+#endif
+	for (; i < count; i++) {
+		times[i] = offset + ticks[i] * scale;
+	}
+}
+
+void QMidiFile::timesFromTicks(const qint32* ticks, double* times, int count)
+{
+	double frames_per_second;
+	switch (fDivType) {
+	case PPQ:
+		frames_per_second = 0;
+		break;
+	case SMPTE24:
+		frames_per_second = 24.0;
+		break;
+	case SMPTE25:
+		frames_per_second = 25.0;
+		break;
+	case SMPTE30DROP:
+		frames_per_second = 29.97;
+		break;
+	case SMPTE30:
+		frames_per_second = 30.0;
+		break;
+	default:
+		for (int i = 0; i < count; i++) {
+			times[i] = -1;
+		}
+		return;
+	}
+	if (frames_per_second > 0) {
+		scale_ticks(ticks, times, count, 0.0, 1.0 / (fResolution * frames_per_second));
+		return;
+	}
+
+	updateTempoMap();
+	const double units_per_second = fResolution * 1000000.0;
+	int i = 0;
+	while (i < count) {
+		/* find the segment of ticks[i], then convert every following tick that
+		 * falls into it in one go; for sorted ticks each segment is visited once */
+		QVector<TempoSegment>::const_iterator it =
+			std::upper_bound(fTempoMap.constBegin(), fTempoMap.constEnd(), ticks[i],
+							 [](qint32 t, const TempoSegment& s) { return t < s.tick; });
+		qint32 end_tick = (it == fTempoMap.constEnd()) ? INT_MAX : it->tick;
+		if (it != fTempoMap.constBegin()) {
+			--it;
+		}
+		qint32 start_tick = (it == fTempoMap.constBegin()) ? INT_MIN : it->tick;
+
+		int j = i + 1;
+		while ((j < count) && (ticks[j] >= start_tick) && (ticks[j] < end_tick)) {
+			j++;
+		}
+		double scale = it->microsPerQuarter / units_per_second;
+		double offset = it->scaledTime / units_per_second - it->tick * scale;
+		scale_ticks(ticks + i, times + i, j - i, offset, scale);
+		i = j;
+	}
+}
+
+void QMidiFile::nanosecondsFromTicks(const qint32* ticks, qint64* nanoseconds, int count)
+{
+	double times[256];
+	for (int i = 0; i < count; i += 256) {
+		int n = qMin(count - i, 256);
+		timesFromTicks(ticks + i, times, n);
+		for (int k = 0; k < n; k++) {
+			nanoseconds[i + k] = qRound64(times[k] * 1000000000.0);
+		}
+	}
+}
+
+QVector<double> QMidiFile::eventTimes()
+{
+	compact();
+	QVector<qint32> ticks(fEvents.size());
+	for (int i = 0; i < fEvents.size(); i++) {
+		ticks[i] = fEvents.at(i)->tick();
+	}
+	QVector<double> times(ticks.size());
+	timesFromTicks(ticks.constData(), times.data(), ticks.size());
+	return times;
+}
+
 float QMidiFile::beatFromTick(qint32 tick)
 {
 	switch (fDivType) {
@@ -564,417 +1307,814 @@ qint32 QMidiFile::tickFromBeat(float beat)
  * Helpers
  */
 
-qint16 interpret_int16(unsigned char* buffer)
+quint16 interpret_uint16(const unsigned char* buffer)
 {
-	return ((qint16)(buffer[0]) << 8) | (qint16)(buffer[1]);
+	return ((quint16)(buffer[0]) << 8) | (quint16)(buffer[1]);
 }
-quint16 interpret_uint16(unsigned char* buffer)
+quint32 interpret_uint32(const unsigned char* buffer)
 {
-	return ((quint16)(buffer[0]) << 8) | (quint16)(buffer[1]);
+	return ((quint32)(buffer[0]) << 24) | ((quint32)(buffer[1]) << 16) |
+		   ((quint32)(buffer[2]) << 8) | (quint32)(buffer[3]);
 }
-quint16 read_uint16(QFile* in)
+void append_uint16(QByteArray* out, quint16 value)
 {
-	unsigned char buffer[2];
-	in->read((char*)buffer, 2);
-	return interpret_uint16(buffer);
+	out->append((char)((value >> 8) & 0xFF));
+	out->append((char)(value & 0xFF));
 }
-void write_uint16(QFile* out, quint16 value)
+void append_uint32(QByteArray* out, quint32 value)
 {
-	unsigned char buffer[2];
-	buffer[0] = (unsigned char)((value >> 8) & 0xFF);
-	buffer[1] = (unsigned char)(value & 0xFF);
-	out->write((char*)buffer, 2);
+	out->append((char)(value >> 24));
+	out->append((char)((value >> 16) & 0xFF));
+	out->append((char)((value >> 8) & 0xFF));
+	out->append((char)(value & 0xFF));
 }
 
-quint32 read_uint32(QFile* in)
+void append_variable_length_quantity(QByteArray* out, quint32 value)
 {
-	unsigned char buffer[4];
-	in->read((char*)&buffer, 4);
-	return ((quint32)(buffer[0]) << 24) | ((quint32)(buffer[1]) << 16) |
-		   ((quint32)(buffer[2]) << 8) | (quint32)(buffer[3]);
+	char buffer[4];
+	int offset = 3;
+
+	forever {
+		buffer[offset] = (char)(value & 0x7F);
+		if (offset < 3) buffer[offset] |= 0x80;
+		value >>= 7;
+		if ((value == 0) || (offset == 0)) {
+			break;
+		}
+		offset--;
+	}
+
+	out->append(buffer + offset, 4 - offset);
 }
-void write_uint32(QFile* out, quint32 value)
+
+/* Decoding state for one MTrk chunk held in memory. Every read is checked
+ * against end, so truncated or corrupt chunks just end the track early. */
+struct TrackCursor {
+	const unsigned char* pos;
+	const unsigned char* end;
+	qint32 tick;
+	unsigned char running_status;
+	bool at_end;
+};
+
+static void init_track_cursor(TrackCursor* c, const unsigned char* data, qint64 size)
 {
-	unsigned char buffer[4];
-	buffer[0] = (unsigned char)(value >> 24);
-	buffer[1] = (unsigned char)((value >> 16) & 0xFF);
-	buffer[2] = (unsigned char)((value >> 8) & 0xFF);
-	buffer[3] = (unsigned char)(value & 0xFF);
-	out->write((char*)buffer, 4);
+	c->pos = data;
+	c->end = data + size;
+	c->tick = 0;
+	c->running_status = 0;
+	c->at_end = false;
 }
 
-quint32 read_variable_length_quantity(QFile* in)
+static bool read_variable_length_quantity(TrackCursor* c, quint32* value)
 {
+	quint32 v = 0;
 	unsigned char b;
-	quint32 value = 0;
 
 	do {
-		in->getChar((char*)&b);
-		value = (value << 7) | (b & 0x7F);
-	} while ((b & 0x80) == 0x80 && !in->atEnd());
+		if (c->pos >= c->end) {
+			return false;
+		}
+		b = *c->pos++;
+		v = (v << 7) | (b & 0x7F);
+	} while ((b & 0x80) == 0x80);
 
-	return value;
+	*value = v;
+	return true;
 }
-void write_variable_length_quantity(QFile* out, quint32 value)
+
+/* Decodes the next event of the track into e. Returns false once the end of
+ * the track (or of the chunk) is reached; e is then left untouched. */
+static bool decode_next_event(TrackCursor* c, QMidiEvent* e)
 {
-	unsigned char buffer[4];
-	int offset = 3;
+	while (!c->at_end) {
+		quint32 delta;
+		if (!read_variable_length_quantity(c, &delta) || (c->pos >= c->end)) {
+			break;
+		}
+		c->tick += delta;
 
-	forever {
-		buffer[offset] = (unsigned char)(value & 0x7F);
-		if (offset < 3) buffer[offset] |= 0x80;
-		value >>= 7;
-		if ((value == 0) || (offset == 0)) {
+		unsigned char status = *c->pos;
+		if ((status & 0x80) == 0x00) {
+			/* running status: this is already the first data byte */
+			status = c->running_status;
+		} else {
+			c->running_status = status;
+			c->pos++;
+		}
+
+		const qint64 available = c->end - c->pos;
+		const char* data = (const char*)c->pos;
+
+		switch (status & 0xF0) {
+		case 0x80:
+		case 0x90:
+		case 0xA0:
+		case 0xB0:
+		case 0xE0: {
+			if (available < 2) {
+				c->at_end = true;
+				return false;
+			}
+			c->pos += 2;
+			*e = QMidiEvent();
+			e->setTick(c->tick);
+			e->setVoice(status & 0x0F);
+			switch (status & 0xF0) {
+			case 0x80:
+				e->setType(QMidiEvent::NoteOff);
+				e->setNote(data[0]);
+				e->setVelocity(data[1]);
+				break;
+			case 0x90:
+				e->setNote(data[0]);
+				if (data[1] != 0) {
+					e->setType(QMidiEvent::NoteOn);
+					e->setVelocity(data[1]);
+				} else {
+					e->setType(QMidiEvent::NoteOff);
+					e->setVelocity(64);
+				}
+				break;
+			case 0xA0:
+				e->setType(QMidiEvent::KeyPressure);
+				e->setNote(data[0]);
+				e->setAmount(data[1]);
+				break;
+			case 0xB0:
+				e->setType(QMidiEvent::ControlChange);
+				e->setNumber(data[0]);
+				e->setValue(data[1]);
+				break;
+			case 0xE0:
+				e->setType(QMidiEvent::PitchWheel);
+				e->setValue(((data[1] & 0x7F) << 7) | (data[0] & 0x7F)); // Unpack 14-bit value
+				break;
+			}
+			return true;
+		}
+		case 0xC0:
+		case 0xD0: {
+			if (available < 1) {
+				c->at_end = true;
+				return false;
+			}
+			c->pos += 1;
+			*e = QMidiEvent();
+			e->setTick(c->tick);
+			e->setVoice(status & 0x0F);
+			if ((status & 0xF0) == 0xC0) {
+				e->setType(QMidiEvent::ProgramChange);
+				e->setNumber(data[0]);
+			} else {
+				e->setType(QMidiEvent::ChannelPressure);
+				e->setAmount(data[0]);
+			}
+			return true;
+		}
+		case 0xF0: {
+			switch (status) {
+			case 0xF0:
+			case 0xF7: {
+				quint32 data_length;
+				if (!read_variable_length_quantity(c, &data_length)) {
+					c->at_end = true;
+					return false;
+				}
+				data_length = qMin<qint64>(data_length, c->end - c->pos);
+				QByteArray bytes;
+				bytes.reserve(data_length + 1);
+				bytes.append((char)status);
+				bytes.append((const char*)c->pos, data_length);
+				c->pos += data_length;
+
+				*e = QMidiEvent();
+				e->setTick(c->tick);
+				e->setType(QMidiEvent::SysEx);
+				e->setData(bytes);
+				return true;
+			}
+			case 0xFF: {
+				if (available < 1) {
+					c->at_end = true;
+					return false;
+				}
+				char number = data[0];
+				c->pos++;
+				quint32 data_length;
+				if (!read_variable_length_quantity(c, &data_length)) {
+					c->at_end = true;
+					return false;
+				}
+				data_length = qMin<qint64>(data_length, c->end - c->pos);
+				const char* bytes = (const char*)c->pos;
+				c->pos += data_length;
+
+				if (number == 0x2F) {
+					c->at_end = true;
+					return false;
+				}
+				*e = QMidiEvent();
+				e->setTick(c->tick);
+				e->setType(QMidiEvent::Meta);
+				e->setNumber(number);
+				e->setData(QByteArray(bytes, data_length));
+				return true;
+			}
+			}
 			break;
 		}
-		offset--;
+		}
+		/* nothing to decode for this status; go on with the next event */
 	}
 
-	out->write((char*)buffer + offset, 4 - offset);
+	c->at_end = true;
+	return false;
 }
 
-bool QMidiFile::load(QString filename)
+/* Location of an MTrk chunk's contents inside the loaded data. */
+struct TrackChunk {
+	const unsigned char* data;
+	qint64 size;
+};
+
+/* Runs tasks[0] on this thread and the rest on the global thread pool, and
+ * returns once every task has released finished. Tasks the pool hasn't
+ * started by then are taken back and run here as well, so this can't
+ * deadlock when called from a pool thread itself (e.g. under QtConcurrent)
+ * with no thread left to run them. */
+template <typename Task>
+static void run_parallel(const QList<Task*>& tasks, QSemaphore* finished)
 {
-	clear();
+	QThreadPool* pool = QThreadPool::globalInstance();
+	for (int i = 1; i < tasks.size(); i++)
+		pool->start(tasks.at(i));
+	tasks.first()->run();
+	for (int i = 1; i < tasks.size(); i++) {
+		if (pool->tryTake(tasks.at(i)))
+			tasks.at(i)->run();
+	}
+	finished->acquire(tasks.size());
+}
 
-	QFile in(filename);
-	if (!in.exists() || !in.open(QFile::ReadOnly)) {
-		return false;
+/* Decodes one MTrk chunk into its own run of events, which comes out in tick
+ * order, using its own pool so that several tracks can be decoded at once. */
+struct TrackDecoder : public QRunnable {
+	TrackChunk chunk;
+	int track;
+	QMidiEventPool pool;
+	QList<QMidiEvent*> events;
+	QSemaphore* finished;
+
+	TrackDecoder(const TrackChunk& c, int t, QSemaphore* f)
+		: chunk(c), track(t), finished(f)
+	{
+		setAutoDelete(false);
 	}
 
-	fDisableSort = true;
-	unsigned char chunk_id[4], division_type_and_resolution[4];
-	qint32 chunk_size = 0, chunk_start = 0;
-	int file_format = 0, number_of_tracks = 0, number_of_tracks_read = 0;
+	void run() override
+	{
+		TrackCursor cursor;
+		init_track_cursor(&cursor, chunk.data, chunk.size);
+
+		QMidiEvent* e = pool.create();
+		while (decode_next_event(&cursor, e)) {
+			e->setTrack(track);
+			events.append(e);
+			e = pool.create();
+		}
+		pool.destroyLast();
 
-	in.read((char*)chunk_id, 4);
-	chunk_size = read_uint32(&in);
-	chunk_start = in.pos();
+		if (finished)
+			finished->release();
+	}
+};
+
+/* Position of an MTrk chunk's contents within the file. */
+struct ChunkSpan {
+	qint64 offset;
+	qint64 size;
+};
+
+/* Parses the MThd header and locates the MTrk chunks of a file of the given
+ * size, looking at it through fetch(pos, count), which returns the count bytes
+ * at pos; the bytes only have to stay valid until the next fetch. Returns
+ * false if the data isn't a (complete) Standard MIDI File; chunks found up to
+ * that point are still returned. */
+template <typename Fetch>
+static bool scan_chunk_spans(Fetch fetch, qint64 size, int* file_format,
+							 unsigned char* division_type_and_resolution,
+							 QVector<ChunkSpan>* tracks)
+{
+	qint64 pos = 0;
+
+	if (size < 8) {
+		return false;
+	}
+	const unsigned char* data = fetch(0, 8);
+	if (!data) {
+		return false;
+	}
+	const unsigned char* chunk_id = data;
+	qint64 chunk_size = interpret_uint32(data + 4);
+	pos = 8;
 
 	/* check for the RMID variation on SMF */
 
 	if (memcmp(chunk_id, "RIFF", 4) == 0) {
-		in.read((char*)chunk_id, 4);
 		/* technically this one is a type id rather than a chunk id */
-
-		if (memcmp(chunk_id, "RMID", 4) != 0) {
-			in.close();
-			fDisableSort = false;
+		if ((size - pos < 20) || !(data = fetch(pos, 20)) || (memcmp(data, "RMID", 4) != 0) ||
+			(memcmp(data + 4, "data", 4) != 0)) {
 			return false;
 		}
+		chunk_id = data + 12;
+		chunk_size = interpret_uint32(data + 16);
+		pos += 20;
+	}
+
+	if ((memcmp(chunk_id, "MThd", 4) != 0) || (size - pos < 6) || !(data = fetch(pos, 6))) {
+		return false;
+	}
+
+	*file_format = interpret_uint16(data);
+	int number_of_tracks = interpret_uint16(data + 2);
+	division_type_and_resolution[0] = data[4];
+	division_type_and_resolution[1] = data[5];
 
-		in.read((char*)chunk_id, 4);
-		chunk_size = read_uint32(&in);
+	/* forwards compatibility:  skip over any extra header data */
+	pos += chunk_size;
 
-		if (memcmp(chunk_id, "data", 4) != 0) {
-			in.close();
-			fDisableSort = false;
+	while (tracks->size() < number_of_tracks) {
+		if ((size - pos < 8) || !(data = fetch(pos, 8)) || (memcmp(data, "MTrk", 4) != 0)) {
+			return false;
+		}
+		chunk_size = interpret_uint32(data + 4);
+		pos += 8;
+
+		ChunkSpan chunk;
+		chunk.offset = pos;
+		chunk.size = qMin(chunk_size, size - pos);
+		tracks->append(chunk);
+		if (chunk.size < chunk_size) {
 			return false;
 		}
 
-		in.read((char*)chunk_id, 4);
-		chunk_size = read_uint32(&in);
-		chunk_start = in.pos();
+		/* forwards compatibility: skip over any unrecognized chunks, or extra
+		 * data at the end of tracks. */
+		pos += chunk_size;
 	}
 
-	if (memcmp(chunk_id, "MThd", 4) != 0) {
-		in.close();
-		fDisableSort = false;
-		return false;
-	}
+	return true;
+}
 
-	file_format = read_uint16(&in);
-	number_of_tracks = read_uint16(&in);
-	in.read((char*)division_type_and_resolution, 2);
+/* scan_chunk_spans() for data that's all in memory */
+static bool scan_chunks(const unsigned char* data, qint64 size, int* file_format,
+						unsigned char* division_type_and_resolution,
+						QVector<TrackChunk>* tracks)
+{
+	QVector<ChunkSpan> spans;
+	bool ok = scan_chunk_spans([data](qint64 pos, qint64) { return data + pos; }, size,
+							   file_format, division_type_and_resolution, &spans);
+
+	for (const ChunkSpan& span : spans) {
+		TrackChunk chunk;
+		chunk.data = data + span.offset;
+		chunk.size = span.size;
+		tracks->append(chunk);
+	}
+	return ok;
+}
 
-	switch ((signed char)(division_type_and_resolution[0])) {
-	case SMPTE24: {
-		fFileFormat = file_format;
-		fDivType = SMPTE24;
-		fResolution = division_type_and_resolution[1];
+static void interpret_division(const unsigned char* buffer, QMidiFile::DivisionType* type,
+							   int* resolution)
+{
+	switch ((signed char)(buffer[0])) {
+	case QMidiFile::SMPTE24:
+	case QMidiFile::SMPTE25:
+	case QMidiFile::SMPTE30DROP:
+	case QMidiFile::SMPTE30:
+		*type = (QMidiFile::DivisionType)(signed char)(buffer[0]);
+		*resolution = buffer[1];
 		break;
-	}
-	case SMPTE25: {
-		fFileFormat = file_format;
-		fDivType = SMPTE25;
-		fResolution = division_type_and_resolution[1];
+	default:
+		*type = QMidiFile::PPQ;
+		*resolution = interpret_uint16(buffer);
 		break;
 	}
-	case SMPTE30DROP: {
-		fFileFormat = file_format;
-		fDivType = SMPTE30DROP;
-		fResolution = division_type_and_resolution[1];
-		break;
+}
+
+bool QMidiFile::load(QString filename)
+{
+	QFile in(filename);
+	if (!in.exists() || !in.open(QFile::ReadOnly)) {
+		clear();
+		return false;
 	}
-	case SMPTE30: {
-		fFileFormat = file_format;
-		fDivType = SMPTE30;
-		fResolution = division_type_and_resolution[1];
-		break;
+
+	/* parse straight out of the mapped file where possible, and fall back to
+	 * reading it into memory when it can't be mapped */
+	qint64 size = in.size();
+	uchar* mapped = (size > 0) ? in.map(0, size) : 0;
+	if (mapped) {
+		bool ret = loadData((const char*)mapped, size);
+		in.unmap(mapped);
+		return ret;
 	}
-	default: {
-		fFileFormat = file_format;
-		fDivType = PPQ;
-		fResolution = interpret_uint16(division_type_and_resolution);
-		break;
+	QByteArray contents = in.readAll();
+	return loadData(contents.constData(), contents.size());
+}
+
+bool QMidiFile::loadData(const char* data, qint64 size)
+{
+	clear();
+
+	int file_format = 0;
+	unsigned char division_type_and_resolution[2] = { 0, 0 };
+	QVector<TrackChunk> chunks;
+
+	bool ok = scan_chunks((const unsigned char*)data, size, &file_format,
+						  division_type_and_resolution, &chunks);
+	if (!ok && chunks.isEmpty()) {
+		return false;
 	}
+
+	fFileFormat = file_format;
+	interpret_division(division_type_and_resolution, &fDivType, &fResolution);
+
+	/* MTrk chunks are independent, so in parallel mode all but the first are
+	 * decoded on the global thread pool while this thread does the first. */
+	const bool parallel = fParallelTracks && (chunks.size() > 1);
+	QSemaphore finished;
+	QList<TrackDecoder*> decoders;
+	for (const TrackChunk& chunk : chunks)
+		decoders.append(new TrackDecoder(chunk, createTrack(), parallel ? &finished : 0));
+
+	if (parallel) {
+		run_parallel(decoders, &finished);
+	} else {
+		for (TrackDecoder* decoder : decoders)
+			decoder->run();
 	}
 
-	/* forwards compatibility:  skip over any extra header data */
-	in.seek(chunk_start + chunk_size);
+	QVector<QList<QMidiEvent*> > runs;
+	for (TrackDecoder* decoder : decoders) {
+		fPool->takeBlocks(&decoder->pool);
+		runs.append(decoder->events);
+		delete decoder;
+	}
+	setEventsFromRuns(runs);
 
-	while (number_of_tracks_read < number_of_tracks) {
-		in.read((char*)chunk_id, 4);
-		chunk_size = read_uint32(&in);
-		chunk_start = in.pos();
+	return ok;
+}
 
-		if (memcmp(chunk_id, "MTrk", 4) == 0) {
-			int track = createTrack();
-			qint32 tick = 0, previous_tick = 0;
-			qint64 previous_pos = 0;
-			unsigned char status, running_status = 0;
-			int at_end_of_track = 0;
+/* End of QMidiFile loading, on to QMidiFileReader */
 
-			while ((in.pos() < chunk_start + chunk_size) && !at_end_of_track) {
-				tick = read_variable_length_quantity(&in) + previous_tick;
-				previous_tick = tick;
+/* How much of each track QMidiFileReader keeps in memory when the file can't
+ * be mapped; only an event larger than this gets a bigger window. */
+static const qint64 reader_window_size = 64 * 1024;
 
-				in.getChar((char*)&status);
+/* The bytes of a track currently in memory, when the file can't be mapped. */
+struct TrackWindow {
+	QByteArray buffer;
+	qint64 offset; /* file position of the first byte after the buffer */
+	qint64 end; /* file position of the end of the chunk */
+};
 
-				if ((status & 0x80) == 0x00) {
-					status = running_status;
-					in.seek(in.pos() - 1);
-				} else {
-					running_status = status;
-				}
-
-				if (in.pos() == previous_pos) {
-					in.close();
-					fDisableSort = false;
-					sort();
-					return false;
-				}
-				previous_pos = in.pos();
-
-				switch (status & 0xF0) {
-				case 0x80: {
-					int channel = status & 0x0F;
-					char note;
-					in.getChar(&note);
-					char velocity;
-					in.getChar(&velocity);
-					createNoteOffEvent(track, tick, channel, note, velocity);
-					break;
-				}
-				case 0x90: {
-					int channel = status & 0x0F;
-					char note;
-					in.getChar(&note);
-					char velocity;
-					in.getChar(&velocity);
-					if (velocity != 0) {
-						createNoteOnEvent(track, tick, channel, note, velocity);
-					} else {
-						createNoteOffEvent(track, tick, channel, note);
-					}
-					break;
-				}
-				case 0xA0: {
-					int channel = status & 0x0F;
-					char note;
-					in.getChar(&note);
-					char amount;
-					in.getChar(&amount);
-					createKeyPressureEvent(track, tick, channel, note, amount);
-					break;
-				}
-				case 0xB0: {
-					int channel = status & 0x0F;
-					char number;
-					in.getChar(&number);
-					char value;
-					in.getChar(&value);
-					createControlChangeEvent(track, tick, channel, number, value);
-					break;
-				}
-				case 0xC0: {
-					int channel = status & 0x0F;
-					char number;
-					in.getChar(&number);
-					createProgramChangeEvent(track, tick, channel, number);
-					break;
-				}
-				case 0xD0: {
-					int channel = status & 0x0F;
-					char amount;
-					in.getChar(&amount);
-					createChannelPressureEvent(track, tick, channel, amount);
-					break;
-				}
-				case 0xE0: {
-					int channel = status & 0x0F;
-					char value;
-					in.getChar(&value);
-					char value2;
-					in.getChar(&value2);
+/* Returns how many bytes from c->pos decode_next_event() will go through for
+ * the next event, or -1 if that depends on bytes past c->end. */
+static qint64 next_event_size(const TrackCursor* c)
+{
+	TrackCursor p = *c;
 
-					qint16 pitch;
-					pitch = ((value2 & 0x7F) << 7) | (value & 0x7F); // Unpack 14-bit value
+	forever {
+		quint32 delta, data_length;
+		if (!read_variable_length_quantity(&p, &delta) || (p.pos >= p.end)) {
+			return -1;
+		}
 
-					createPitchWheelEvent(track, tick, channel, pitch);
-					break;
-				}
-				case 0xF0: {
-					switch (status) {
-					case 0xF0:
-					case 0xF7: {
-						int data_length = read_variable_length_quantity(&in) + 1;
-						QByteArray data(1, 0);
-						data[0] = status;
-						data += in.read(data_length - 1);
-
-						createSysexEvent(track, tick, data);
-						break;
-					}
-					case 0xFF: {
-						char number;
-						in.getChar(&number);
-						int data_length = read_variable_length_quantity(&in);
-						QByteArray data = in.read(data_length);
-
-						if (number == 0x2F) {
-							at_end_of_track = 1;
-						} else {
-							createMetaEvent(track, tick, number, data);
-						}
-						break;
-					}
-					}
+		unsigned char status = *p.pos;
+		if ((status & 0x80) == 0x00) {
+			status = p.running_status;
+		} else {
+			p.running_status = status;
+			p.pos++;
+		}
 
-					break;
-				}
+		switch (status & 0xF0) {
+		case 0x80:
+		case 0x90:
+		case 0xA0:
+		case 0xB0:
+		case 0xE0:
+			return (p.pos - c->pos) + 2;
+		case 0xC0:
+		case 0xD0:
+			return (p.pos - c->pos) + 1;
+		case 0xF0:
+			if (status == 0xFF) {
+				if (p.pos >= p.end) {
+					return -1;
 				}
+				p.pos++;
+			} else if ((status != 0xF0) && (status != 0xF7)) {
+				continue;
+			}
+			if (!read_variable_length_quantity(&p, &data_length)) {
+				return -1;
 			}
+			return (p.pos - c->pos) + data_length;
+		}
+	}
+}
 
-			number_of_tracks_read++;
-		} else {
-			in.close();
-			fDisableSort = false;
-			sort();
-			return false;
+/* Makes sure the window holds all of the next event of its track, keeping the
+ * unread part and reading on from the file behind it. */
+static void fill_window(QFile* file, TrackWindow* w, TrackCursor* c)
+{
+	forever {
+		const qint64 left = c->end - c->pos;
+		const qint64 needed = next_event_size(c);
+		if (((needed >= 0) && (needed <= left)) || (w->offset >= w->end)) {
+			return;
 		}
 
-		/* forwards compatibility: skip over any unrecognized chunks, or extra
-		 * data at the end of tracks. */
-		in.seek(chunk_start + chunk_size);
+		qint64 size = qMax(reader_window_size, (needed >= 0) ? needed : 2 * left);
+		size = qMin(size, left + (w->end - w->offset));
+
+		QByteArray buffer;
+		buffer.reserve(size);
+		buffer.append((const char*)c->pos, left);
+		buffer.resize(size);
+		qint64 count = file->seek(w->offset) ? file->read(buffer.data() + left, size - left) : -1;
+		if (count <= 0) {
+			/* treat it like the chunk ending here */
+			count = 0;
+			w->end = w->offset;
+		}
+		buffer.resize(left + count);
+		w->offset += count;
+
+		w->buffer = buffer;
+		c->pos = (const unsigned char*)w->buffer.constData();
+		c->end = c->pos + w->buffer.size();
 	}
+}
 
-	in.close();
-	fDisableSort = false;
-	sort();
-	return true;
+struct QMidiFileReaderState {
+	QFile file;
+	uchar* mapped;
+	QVector<TrackWindow> windows; /* used when the file can't be mapped */
+
+	QVector<TrackCursor> cursors;
+	QVector<QMidiEvent> pending; /* next event of each track */
+	QVector<RunHead> heap; /* tracks with a pending event */
+
+	QMidiFileReaderState(const QString& filename) : file(filename), mapped(0) {}
+	~QMidiFileReaderState()
+	{
+		if (mapped)
+			file.unmap(mapped);
+	}
+
+	/* decodes the next event of a track into pending, reading more of the
+	 * track first if it isn't mapped */
+	bool decodeNext(int track)
+	{
+		if (!windows.isEmpty())
+			fill_window(&file, &windows[track], &cursors[track]);
+		return decode_next_event(&cursors[track], &pending[track]);
+	}
+};
+
+QMidiFileReader::QMidiFileReader()
+	: fState(0),
+	  fDivType(QMidiFile::Invalid),
+	  fResolution(0),
+	  fFileFormat(0)
+{
+}
+QMidiFileReader::~QMidiFileReader()
+{
+	close();
 }
 
-bool QMidiFile::save(QString filename)
+bool QMidiFileReader::open(QString filename)
 {
-	QFile out(filename);
+	close();
 
-	if (out.exists()) {
-		out.remove();
+	fState = new QMidiFileReaderState(filename);
+	QFile& in = fState->file;
+	if (!in.exists() || !in.open(QFile::ReadOnly)) {
+		close();
+		return false;
 	}
-	if ((filename == "") || !(out.open(QFile::WriteOnly))) {
+
+	/* read straight out of the mapped file where possible; otherwise only a
+	 * window onto each track is kept in memory, so that files larger than
+	 * the address space can still be read */
+	qint64 size = in.size();
+	fState->mapped = (size > 0) ? in.map(0, size) : 0;
+
+	unsigned char division_type_and_resolution[2] = { 0, 0 };
+	QVector<ChunkSpan> chunks;
+	bool ok;
+	if (fState->mapped) {
+		const unsigned char* data = fState->mapped;
+		ok = scan_chunk_spans([data](qint64 pos, qint64) { return data + pos; }, size,
+							  &fFileFormat, division_type_and_resolution, &chunks);
+	} else {
+		QByteArray header;
+		ok = scan_chunk_spans(
+			[&in, &header](qint64 pos, qint64 count) -> const unsigned char* {
+				if (!in.seek(pos) || ((header = in.read(count)).size() < count))
+					return 0;
+				return (const unsigned char*)header.constData();
+			},
+			size, &fFileFormat, division_type_and_resolution, &chunks);
+	}
+	if (!ok && chunks.isEmpty()) {
+		close();
 		return false;
 	}
+	interpret_division(division_type_and_resolution, &fDivType, &fResolution);
+
+	/* prime every track with its first event */
+	fState->cursors.resize(chunks.size());
+	fState->pending.resize(chunks.size());
+	if (!fState->mapped)
+		fState->windows.resize(chunks.size());
+	for (int i = 0; i < chunks.size(); i++) {
+		const ChunkSpan& chunk = chunks.at(i);
+		if (fState->mapped) {
+			init_track_cursor(&fState->cursors[i], fState->mapped + chunk.offset, chunk.size);
+		} else {
+			TrackWindow& w = fState->windows[i];
+			w.offset = chunk.offset;
+			w.end = chunk.offset + chunk.size;
+			init_track_cursor(&fState->cursors[i], 0, 0);
+		}
+		if (fState->decodeNext(i)) {
+			RunHead h = { fState->pending[i].tick(), i, 0 };
+			fState->heap.append(h);
+		}
+	}
+	std::make_heap(fState->heap.begin(), fState->heap.end(), runHeadAfter);
+	return true;
+}
 
-	out.write("MThd", 4);
-	write_uint32(&out, 6);
-	write_uint16(&out, (quint16)(fFileFormat));
-	write_uint16(&out, (quint16)(fTracks.size()));
+void QMidiFileReader::close()
+{
+	delete fState;
+	fState = 0;
+	fDivType = QMidiFile::Invalid;
+	fResolution = 0;
+	fFileFormat = 0;
+}
 
-	switch (fDivType) {
-	case PPQ:
-		write_uint16(&out, (quint16)(fResolution));
-		break;
-	default:
-		out.putChar(fDivType);
-		out.putChar(fResolution);
-		break;
+int QMidiFileReader::trackCount()
+{
+	return fState ? fState->cursors.size() : 0;
+}
+
+bool QMidiFileReader::atEnd()
+{
+	return !fState || fState->heap.isEmpty();
+}
+
+bool QMidiFileReader::readNext(QMidiEvent* e)
+{
+	if (atEnd()) {
+		return false;
 	}
 
-	for (int curTrack : fTracks) {
-		qint32 track_size_offset, track_start_offset, track_end_offset, tick, previous_tick;
+	QVector<RunHead>& heap = fState->heap;
+	std::pop_heap(heap.begin(), heap.end(), runHeadAfter);
+	const int track = heap.last().run;
 
-		out.write("MTrk", 4);
+	QMidiEvent& next = fState->pending[track];
+	*e = next;
+	e->setTrack(track);
 
-		track_size_offset = out.pos();
-		write_uint32(&out, 0);
+	if (fState->decodeNext(track)) {
+		heap.last().tick = next.tick();
+		std::push_heap(heap.begin(), heap.end(), runHeadAfter);
+	} else {
+		heap.removeLast();
+	}
+	return true;
+}
 
-		track_start_offset = out.pos();
+/* End of QMidiFileReader, on to saving */
+
+/* Encodes one track, chunk header included, into a buffer of its own so the
+ * chunk length is known before anything is written, and so that several
+ * tracks can be encoded at once. */
+struct TrackEncoder : public QRunnable {
+	QList<QMidiEvent*> events;
+	qint32 end_tick;
+	bool use_running_status;
+	unsigned char running_status;
+	qint64 bytes_saved;
+	QByteArray chunk;
+	QSemaphore* finished;
+
+	TrackEncoder(const QList<QMidiEvent*>& e, qint32 end, bool running, QSemaphore* f)
+		: events(e), end_tick(end), use_running_status(running), running_status(0),
+		  bytes_saved(0), finished(f)
+	{
+		setAutoDelete(false);
+	}
+
+	/* leaves out status bytes repeating the previous one, if enabled */
+	void append_status(unsigned char status)
+	{
+		if (use_running_status && (status == running_status)) {
+			bytes_saved++;
+			return;
+		}
+		chunk.append((char)status);
+		running_status = status;
+	}
 
-		previous_tick = 0;
+	void run() override
+	{
+		qint32 tick, previous_tick = 0;
 
-		QList<QMidiEvent*> eventsForTrk = eventsForTrack(curTrack);
-		for (QMidiEvent* e : eventsForTrk) {
+		chunk.reserve(8 + events.size() * 4 + 4);
+		chunk.append("MTrk", 4);
+		append_uint32(&chunk, 0); /* patched below */
+
+		for (QMidiEvent* e : events) {
 			tick = e->tick();
-			write_variable_length_quantity(&out, tick - previous_tick);
+			append_variable_length_quantity(&chunk, tick - previous_tick);
 
 			switch (e->type()) {
 			case QMidiEvent::NoteOff:
-				out.putChar(0x80 | (e->voice() & 0x0F));
-				out.putChar(e->note() & 0x7F);
-				out.putChar(e->velocity() & 0x7F);
+				if (use_running_status && (e->velocity() == 64) &&
+					(running_status == (0x90 | (e->voice() & 0x0F)))) {
+					/* load() reads this back as the same NoteOff */
+					append_status(running_status);
+					chunk.append((char)(e->note() & 0x7F));
+					chunk.append((char)0);
+					break;
+				}
+				append_status(0x80 | (e->voice() & 0x0F));
+				chunk.append((char)(e->note() & 0x7F));
+				chunk.append((char)(e->velocity() & 0x7F));
 				break;
 
 			case QMidiEvent::NoteOn:
-				out.putChar(0x90 | (e->voice() & 0x0F));
-				out.putChar(e->note() & 0x7F);
-				out.putChar(e->velocity() & 0x7F);
+				append_status(0x90 | (e->voice() & 0x0F));
+				chunk.append((char)(e->note() & 0x7F));
+				chunk.append((char)(e->velocity() & 0x7F));
 				break;
 
 			case QMidiEvent::KeyPressure:
-				out.putChar(0xA0 | (e->voice() & 0x0F));
-				out.putChar(e->note() & 0x7F);
-				out.putChar(e->amount() & 0x7F);
+				append_status(0xA0 | (e->voice() & 0x0F));
+				chunk.append((char)(e->note() & 0x7F));
+				chunk.append((char)(e->amount() & 0x7F));
 				break;
 
 			case QMidiEvent::ControlChange:
-				out.putChar(0xB0 | (e->voice() & 0x0F));
-				out.putChar(e->number() & 0x7F);
-				out.putChar(e->value() & 0x7F);
+				append_status(0xB0 | (e->voice() & 0x0F));
+				chunk.append((char)(e->number() & 0x7F));
+				chunk.append((char)(e->value() & 0x7F));
 				break;
 
 			case QMidiEvent::ProgramChange:
-				out.putChar(0xC0 | (e->voice() & 0x0F));
-				out.putChar(e->number() & 0x7F);
+				append_status(0xC0 | (e->voice() & 0x0F));
+				chunk.append((char)(e->number() & 0x7F));
 				break;
 
 			case QMidiEvent::ChannelPressure:
-				out.putChar(0xD0 | (e->voice() & 0x0F));
-				out.putChar(e->value() & 0x7F);
+				append_status(0xD0 | (e->voice() & 0x0F));
+				chunk.append((char)(e->value() & 0x7F));
 				break;
 
 			case QMidiEvent::PitchWheel: {
 				int value = e->value();
-				out.putChar(0xE0 | (e->voice() & 0x0F));
-				out.putChar(value & 0x7F);
-				out.putChar((value >> 7) & 0x7F);
+				append_status(0xE0 | (e->voice() & 0x0F));
+				chunk.append((char)(value & 0x7F));
+				chunk.append((char)((value >> 7) & 0x7F));
 				break;
 			}
 			case QMidiEvent::SysEx: {
-				int data_length = e->data().size();
-				unsigned char* data = (unsigned char*)e->data().constData();
-				out.putChar(data[0]);
-				write_variable_length_quantity(&out, data_length - 1);
-				out.write((char*)data + 1, data_length - 1);
+				QByteArray data = e->data();
+				int data_length = data.size();
+				running_status = 0; /* SysEx and Meta events cancel running status */
+				chunk.append(data_length > 0 ? data.at(0) : (char)0);
+				append_variable_length_quantity(&chunk, data_length - 1);
+				if (data_length > 1)
+					chunk.append(data.constData() + 1, data_length - 1);
 				break;
 			}
 			case QMidiEvent::Meta: {
-				int data_length = e->data().size();
-				unsigned char* data = (unsigned char*)e->data().constData();
-				out.putChar(0xFF);
-				out.putChar(e->number() & 0x7F);
-				write_variable_length_quantity(&out, data_length);
-				out.write((char*)data, data_length);
+				QByteArray data = e->data();
+				running_status = 0;
+				chunk.append((char)0xFF);
+				chunk.append((char)(e->number() & 0x7F));
+				append_variable_length_quantity(&chunk, data.size());
+				chunk.append(data);
 				break;
 			}
 			default:
@@ -984,17 +2124,76 @@ bool QMidiFile::save(QString filename)
 			previous_tick = tick;
 		}
 
-		write_variable_length_quantity(&out, trackEndTick(curTrack) - previous_tick);
-		out.write("\xFF\x2F\x00", 3);
+		append_variable_length_quantity(&chunk, end_tick - previous_tick);
+		chunk.append("\xFF\x2F\x00", 3);
 
-		track_end_offset = out.pos();
+		const quint32 size = chunk.size() - 8;
+		chunk[4] = (char)(size >> 24);
+		chunk[5] = (char)((size >> 16) & 0xFF);
+		chunk[6] = (char)((size >> 8) & 0xFF);
+		chunk[7] = (char)(size & 0xFF);
 
-		out.seek(track_size_offset);
-		write_uint32(&out, track_end_offset - track_start_offset);
+		if (finished)
+			finished->release();
+	}
+};
+
+bool QMidiFile::save(QString filename)
+{
+	QFile out(filename);
 
-		out.seek(track_end_offset);
+	if (out.exists()) {
+		out.remove();
+	}
+	if ((filename == "") || !(out.open(QFile::WriteOnly))) {
+		return false;
 	}
 
+	bool ret = save(&out);
 	out.close();
-	return true;
+	return ret;
+}
+
+bool QMidiFile::save(QIODevice* out)
+{
+	QByteArray header;
+	header.append("MThd", 4);
+	append_uint32(&header, 6);
+	append_uint16(&header, (quint16)(fFileFormat));
+	append_uint16(&header, (quint16)(fTracks.size()));
+
+	switch (fDivType) {
+	case PPQ:
+		append_uint16(&header, (quint16)(fResolution));
+		break;
+	default:
+		header.append((char)fDivType);
+		header.append((char)fResolution);
+		break;
+	}
+
+	const bool parallel = fParallelTracks && (fTracks.size() > 1);
+	QSemaphore finished;
+	QList<TrackEncoder*> encoders;
+	for (int curTrack : fTracks) {
+		encoders.append(new TrackEncoder(eventsForTrack(curTrack), trackEndTick(curTrack),
+										 fRunningStatus, parallel ? &finished : 0));
+	}
+
+	if (parallel) {
+		run_parallel(encoders, &finished);
+	} else {
+		for (TrackEncoder* encoder : encoders)
+			encoder->run();
+	}
+
+	bool ok = (out->write(header) == header.size());
+	fRunningStatusSavings = 0;
+	for (TrackEncoder* encoder : encoders) {
+		fRunningStatusSavings += encoder->bytes_saved;
+		if (ok)
+			ok = (out->write(encoder->chunk) == encoder->chunk.size());
+		delete encoder;
+	}
+	return ok;
 }
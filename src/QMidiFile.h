@@ -6,8 +6,15 @@
 #pragma once
 
 #include <QString>
+#include <QHash>
 #include <QMap>
 #include <QList>
+#include <QVector>
+#include <functional>
+
+class QIODevice;
+class QMidiFile;
+struct QMidiEventPool;
 
 class QMidiEvent
 {
@@ -35,44 +42,51 @@ public:
 	};
 
 	QMidiEvent();
+	QMidiEvent(const QMidiEvent& other);
 	~QMidiEvent();
+	QMidiEvent& operator=(const QMidiEvent& other);
 
-	inline EventType type() const { return fType; }
+	inline EventType type() const { return (EventType)fType; }
 	inline void setType(EventType newType) { fType = newType; }
 
 	inline qint32 tick() { return fTick; }
 	inline void setTick(qint32 tick) { fTick = tick; }
-	/* you MUST run the QMidiFile's sort() function after changing ticks! */
-	/* otherwise, it will not play or write the file properly! */
+	/* you MUST run the QMidiFile's sort() function after changing ticks, */
+	/* tracks or voices! otherwise, it will not play or write the file properly! */
+
+	/* Voices are 0-15, and notes, velocities, amounts and numbers 0-127;
+	 * values are 0-16383 for PitchWheel and 0-127 for ControlChange. -1
+	 * means unset. Anything that doesn't fit the (small) fields is clamped,
+	 * and debug builds assert. */
 
 	inline int track() { return fTrackNumber; }
 	inline void setTrack(int trackNumber) { fTrackNumber = trackNumber; }
 
 	inline int voice() { return fVoice; }
-	inline void setVoice(int voice) { fVoice = voice; }
+	inline void setVoice(int voice) { fVoice = toInt8(voice); }
 
 	inline int note() { return fNote; }
-	inline void setNote(int note) { fNote = note; }
+	inline void setNote(int note) { fNote = toInt8(note); }
 
 	inline int velocity() { return fVelocity; }
-	inline void setVelocity(int velocity) { fVelocity = velocity; }
+	inline void setVelocity(int velocity) { fVelocity = toInt8(velocity); }
 
 	inline int amount() { return fAmount; }
-	inline void setAmount(int amount) { fAmount = amount; }
+	inline void setAmount(int amount) { fAmount = toInt8(amount); }
 
 	inline int number() { return fNumber; }
-	inline void setNumber(int number) { fNumber = number; }
+	inline void setNumber(int number) { fNumber = toInt8(number); }
 
 	inline int value() { return fValue; }
-	inline void setValue(int value) { fValue = value; }
+	inline void setValue(int value) { fValue = toInt16(value); }
 
 	float tempo();
 
 	inline int numerator() { return fNumerator; }
-	inline void setNumerator(int numerator) { fNumerator = numerator; }
+	inline void setNumerator(int numerator) { fNumerator = toInt16(numerator); }
 
 	inline int denominator() { return fDenominator; }
-	inline void setDenominator(int denominator) { fDenominator = denominator; }
+	inline void setDenominator(int denominator) { fDenominator = toInt16(denominator); }
 
 	inline QByteArray data() const { return fData; }
 	inline void setData(QByteArray data) { fData = data; }
@@ -83,19 +97,124 @@ public:
 	inline bool isNoteEvent() { return ((fType == NoteOn) || (fType == NoteOff)); }
 
 private:
-	int fVoice;
-	int fNote;
-	int fVelocity;
-	int fAmount;	// KeyPressure, ChannelPressure
-	int fNumber;	// ControlChange, ProgramChange, Meta
-	int fValue;		// PitchWheel, ControlChange
-	int fNumerator; // TimeSignature
-	int fDenominator; // TimeSignature
+	friend class QMidiFile;
+	friend struct QMidiEventPool;
+
+	static inline qint8 toInt8(int v)
+	{
+		Q_ASSERT((v >= -128) && (v <= 127));
+		return (qint8)qBound(-128, v, 127);
+	}
+	static inline qint16 toInt16(int v)
+	{
+		Q_ASSERT((v >= -32768) && (v <= 32767));
+		return (qint16)qBound(-32768, v, 32767);
+	}
+
+	/* Fields are sized for the ranges MIDI allows (7-bit data bytes, 14-bit
+	 * pitch wheel values), with -1 meaning "unset", and ordered so there is
+	 * no padding between them; this keeps events small when files hold many
+	 * thousands of them. */
 	QByteArray fData; // Meta, SysEx
-
 	qint32 fTick;
-	EventType fType;
-	int fTrackNumber;
+	qint32 fTrackNumber;
+	qint16 fValue;		// PitchWheel, ControlChange
+	qint16 fNumerator; // TimeSignature
+	qint16 fDenominator; // TimeSignature
+	qint8 fType;
+	qint8 fVoice;
+	qint8 fNote;
+	qint8 fVelocity;
+	qint8 fAmount;	// KeyPressure, ChannelPressure
+	qint8 fNumber;	// ControlChange, ProgramChange, Meta
+	bool fPooled; // allocated by a QMidiFile's pool, not with new
+	bool fRemoved; // removed from its QMidiFile (pooled events stay marked)
+};
+
+/* A note made of a NoteOn and its matching NoteOff, see QMidiFile::notes() */
+struct QMidiNote {
+	qint32 startTick;
+	qint32 endTick;
+	int track;
+	int voice;
+	int note;
+	int velocity;
+	int offVelocity; /* -1 if the note is never turned off */
+	QMidiEvent* noteOn;
+	QMidiEvent* noteOff; /* 0 if the note is never turned off */
+};
+
+/* A view of consecutive events of a QMidiFile, optionally only those of one
+ * type. It points into the file's lists instead of copying them, so it is only
+ * valid until the file is next changed. */
+class QMidiEventRange
+{
+public:
+	class const_iterator
+	{
+	public:
+		inline QMidiEvent* operator*() const { return *fIt; }
+		inline const_iterator& operator++()
+		{
+			++fIt;
+			skip();
+			return *this;
+		}
+		inline bool operator==(const const_iterator& other) const { return fIt == other.fIt; }
+		inline bool operator!=(const const_iterator& other) const { return fIt != other.fIt; }
+
+	private:
+		friend class QMidiEventRange;
+		inline void skip()
+		{
+			while ((fIt != fEnd) && (fType != QMidiEvent::Invalid) && ((*fIt)->type() != fType))
+				++fIt;
+		}
+
+		QList<QMidiEvent*>::const_iterator fIt;
+		QList<QMidiEvent*>::const_iterator fEnd;
+		QMidiEvent::EventType fType;
+	};
+
+	QMidiEventRange(QList<QMidiEvent*>::const_iterator begin,
+					QList<QMidiEvent*>::const_iterator end,
+					QMidiEvent::EventType type = QMidiEvent::Invalid)
+		: fBegin(begin), fEnd(end), fType(type)
+	{
+	}
+
+	inline const_iterator begin() const
+	{
+		const_iterator it;
+		it.fIt = fBegin;
+		it.fEnd = fEnd;
+		it.fType = fType;
+		it.skip();
+		return it;
+	}
+	inline const_iterator end() const
+	{
+		const_iterator it;
+		it.fIt = fEnd;
+		it.fEnd = fEnd;
+		it.fType = fType;
+		return it;
+	}
+	inline bool isEmpty() const { return begin() == end(); }
+	int count() const
+	{
+		if (fType == QMidiEvent::Invalid)
+			return fEnd - fBegin;
+		int n = 0;
+		for (const_iterator it = begin(); it != end(); ++it)
+			n++;
+		return n;
+	}
+
+private:
+	QList<QMidiEvent*>::const_iterator fBegin;
+	QList<QMidiEvent*>::const_iterator fEnd;
+	QMidiEvent::EventType fType;
 };
 
 class QMidiFile
@@ -117,12 +236,40 @@ public:
 
 	void clear();
 	bool load(QString filename);
+	/* loads a Standard MIDI File (or RMID) from memory; data is not kept */
+	bool loadData(const char* data, qint64 size);
 	bool save(QString filename);
+	/* writes sequentially, so out may be a pipe or socket */
+	bool save(QIODevice* out);
 
 	QMidiFile* oneTrackPerVoice();
 
 	void sort();
 
+	/* Between beginBatch() and commitBatch(), addEvent() and the create*Event()
+	 * functions only append; the new events are merged into place once when the
+	 * outermost batch is committed. Batches may be nested. Prefer QMidiFileBatch,
+	 * which commits even if an exception is thrown. Until the commit, the
+	 * cached per-track and per-voice lists leave the new events out. */
+	void beginBatch();
+	void commitBatch();
+	inline bool inBatch() { return fBatchDepth > 0; }
+
+	/* Decode the tracks of a file in load(), and encode them in save(), on
+	 * the global QThreadPool. This pays off for files with many large
+	 * tracks. */
+	inline void setParallelTracks(bool parallel) { fParallelTracks = parallel; }
+	inline bool parallelTracks() { return fParallelTracks; }
+
+	/* Leave out status bytes that repeat the previous one in save(), writing
+	 * NoteOffs with velocity 64 as NoteOns with velocity 0 where that helps.
+	 * Files get up to a third smaller; this is off by default since some simple
+	 * readers don't handle running status although the standard requires it.
+	 * runningStatusSavings() is the number of bytes it saved in the last save(). */
+	inline void setRunningStatus(bool running) { fRunningStatus = running; }
+	inline bool runningStatus() { return fRunningStatus; }
+	inline qint64 runningStatusSavings() { return fRunningStatusSavings; }
+
 	inline void setFileFormat(int fileFormat) { fFileFormat = fileFormat; }
 	inline int fileFormat() { return fFileFormat; }
 
@@ -132,8 +279,22 @@ public:
 	inline void setDivisionType(DivisionType type) { fDivType = type; }
 	inline DivisionType divisionType() { return fDivType; }
 
+	/* Events made by load(), oneTrackPerVoice(), allocateEvent() and the
+	 * create*Event() functions come from a pool owned by this file, and must
+	 * never be deleted by the caller (debug builds assert). Once removed,
+	 * they stay valid, and may be re-added with addEvent(), until clear() or
+	 * load().
+	 * Events allocated with new and passed to addEvent() are deleted by
+	 * clear(), or belong to the caller again as soon as removeEvent() or
+	 * removeEvents() returns, as before. */
+	QMidiEvent* allocateEvent();
 	void addEvent(qint32 tick, QMidiEvent* e);
+	/* pooled events are removed lazily in O(log n), others right away */
 	void removeEvent(QMidiEvent* e);
+	/* remove many events at once, compacting the file in a single pass */
+	void removeEvents(const QList<QMidiEvent*>& events);
+	void removeEvents(qint32 start_tick, qint32 end_tick); /* [start_tick, end_tick) */
+	void removeEvents(std::function<bool(QMidiEvent*)> predicate);
 
 	int createTrack();
 	void removeTrack(int track);
@@ -161,22 +322,144 @@ public:
 	QMidiEvent* createMarkerEvent(int track, qint32 tick, QByteArray text);
 	QMidiEvent* createVoiceEvent(int track, qint32 tick, quint32 data);
 
-	inline QList<QMidiEvent*> events() { return QList<QMidiEvent*>(fEvents); }
-	QList<QMidiEvent*> events(int voice);
-	QList<QMidiEvent*> eventsForTrack(int track);
-
-	float timeFromTick(qint32 tick); /* time is in seconds */
-	qint32 tickFromTime(float time);
+	inline QList<QMidiEvent*> events()
+	{
+		compact();
+		return QList<QMidiEvent*>(fEvents);
+	}
+	QList<QMidiEvent*> events(int voice); /* cached, so cheap to call */
+	/* events of one type on a voice, e.g. (9, ControlChange, 7) for all volume
+	 * changes on the drum channel; number -1 matches any number. Cached like
+	 * events(voice), so repeated calls are cheap until the file changes. */
+	QList<QMidiEvent*> events(int voice, QMidiEvent::EventType type, int number = -1);
+	QList<QMidiEvent*> eventsForTrack(int track); /* cached, so cheap to call */
+
+	/* Events with start_tick <= tick < end_tick, found by binary search and
+	 * returned without copying; type Invalid means events of any type. None
+	 * of these include events added in an unfinished batch: eventsInRange()
+	 * stops where the batch starts, and the per-track and per-voice lists
+	 * leave batch events out until commitBatch(). */
+	QMidiEventRange eventsInRange(qint32 start_tick, qint32 end_tick,
+								  QMidiEvent::EventType type = QMidiEvent::Invalid);
+	QMidiEventRange eventsInRangeForTrack(int track, qint32 start_tick, qint32 end_tick,
+										  QMidiEvent::EventType type = QMidiEvent::Invalid);
+	QMidiEventRange eventsInRangeForVoice(int voice, qint32 start_tick, qint32 end_tick,
+										  QMidiEvent::EventType type = QMidiEvent::Invalid);
+
+	/* All notes, sorted by start tick; cached until events are next added or
+	 * removed (call sort() after changing the note, voice or velocity of a note
+	 * event). */
+	QVector<QMidiNote> notes();
+	/* notes sounding at any point in [start_tick, end_tick), with
+	 * low_note <= note <= high_note */
+	QVector<QMidiNote> notesInRange(qint32 start_tick, qint32 end_tick, int low_note = 0,
+									int high_note = 127);
+
+	/* time is in seconds; tempo changes are looked up in a cached map, so
+	 * these are cheap even for files with many tempo events */
+	double timeFromTick(qint32 tick);
+	qint32 tickFromTime(double time);
+	/* converts count ticks at once, much faster than calling timeFromTick()
+	 * in a loop; sorted ticks walk the tempo map only once. The results are
+	 * rounded differently, so they may differ from timeFromTick() in the last
+	 * bits. */
+	void timesFromTicks(const qint32* ticks, double* times, int count);
+	void nanosecondsFromTicks(const qint32* ticks, qint64* nanoseconds, int count);
+	QVector<double> eventTimes(); /* seconds for each of events() */
 	float beatFromTick(qint32 tick);
 	qint32 tickFromBeat(float beat);
 
 private:
+	Q_DISABLE_COPY(QMidiFile)
+
+	struct TempoSegment {
+		qint32 tick;
+		qint64 scaledTime; /* microseconds times resolution */
+		qint32 microsPerQuarter;
+	};
+
+	void setEventsFromRuns(const QVector<QList<QMidiEvent*> >& runs);
+	void updateIndex();
+	bool takeOut(QMidiEvent* e);
+	bool markRemoved(QMidiEvent* e);
+	void compact();
+	void updateTempoMap();
+	void updateNotes();
+
+	QMidiEventPool* fPool;
 	QList<QMidiEvent*> fEvents;
 	QList<QMidiEvent*> fTempoEvents;
 	QList<int> fTracks;
+	/* events of each track and voice, in order; rebuilt by updateIndex() when
+	 * invalid */
+	QMap<int, QList<QMidiEvent*> > fTrackIndex;
+	QMap<int, QList<QMidiEvent*> > fVoiceIndex;
+	/* results of events(voice, type, number), dropped whenever the index
+	 * changes */
+	QHash<quint64, QList<QMidiEvent*> > fFilteredIndex;
+	bool fIndexValid;
+	/* tempo changes of track 0 with their start times; rebuilt by
+	 * updateTempoMap() when tempo events are added, removed or sorted (so
+	 * call sort() after editing the data of a tempo event) */
+	QVector<TempoSegment> fTempoMap;
+	bool fTempoMapValid;
+	/* paired notes, rebuilt by updateNotes() when note events change */
+	QVector<QMidiNote> fNotes;
+	qint64 fMaxNoteLength;
+	bool fNotesValid;
 	DivisionType fDivType;
 	int fResolution;
 	int fFileFormat;
+	bool fParallelTracks;
+	bool fRunningStatus;
+	qint64 fRunningStatusSavings;
+	int fRemovedCount;
+
+	int fBatchDepth;
+	int fBatchStart;
+	int fTempoBatchStart;
+	bool fBatchNeedsFullSort;
+};
 
-	bool fDisableSort;
+struct QMidiFileReaderState;
+
+/* Reads the events of a MIDI file one at a time, in the same order load()
+ * would put them in, without keeping them all in memory: only the next event
+ * of each track is decoded ahead. Useful for files too large to load. */
+class QMidiFileReader
+{
+public:
+	QMidiFileReader();
+	~QMidiFileReader();
+
+	bool open(QString filename);
+	void close();
+
+	inline int fileFormat() { return fFileFormat; }
+	inline int resolution() { return fResolution; }
+	inline QMidiFile::DivisionType divisionType() { return fDivType; }
+	int trackCount();
+
+	/* copies the next event into e; returns false after the last one */
+	bool readNext(QMidiEvent* e);
+	bool atEnd();
+
+private:
+	Q_DISABLE_COPY(QMidiFileReader)
+
+	QMidiFileReaderState* fState;
+	QMidiFile::DivisionType fDivType;
+	int fResolution;
+	int fFileFormat;
+};
+
+class QMidiFileBatch
+{
+public:
+	explicit QMidiFileBatch(QMidiFile* file) : fFile(file) { fFile->beginBatch(); }
+	~QMidiFileBatch() { fFile->commitBatch(); }
+
+private:
+	Q_DISABLE_COPY(QMidiFileBatch)
+	QMidiFile* fFile;
 };
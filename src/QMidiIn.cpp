@@ -4,9 +4,188 @@
  */
 #include "QMidiIn.h"
 
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QVector>
+
+#include <chrono>
+
+#if defined(Q_OS_MACOS)
+#include <CoreAudio/HostTime.h>
+#endif
+
+/* A single-producer, single-consumer ring of received messages: the backend's
+ * receiving thread only writes fTail, the reader only writes fHead. */
+class QMidiInBuffer
+{
+public:
+	explicit QMidiInBuffer(int capacity);
+	~QMidiInBuffer();
+
+	bool push(quint32 message, quint32 timing, qint64 timestamp);
+	int pop(QMidiInMessage* messages, int max);
+
+	QAtomicInt notified;
+	QAtomicInt dropped;
+
+private:
+	QMidiInMessage* fMessages;
+	quint32 fMask;
+
+	/* padded onto cache lines of their own, as they are written by different
+	 * threads; alignas() isn't honoured by new before C++17 */
+	char fPad0[64];
+	QAtomicInteger<quint32> fHead;
+	char fPad1[64 - sizeof(QAtomicInteger<quint32>)];
+	QAtomicInteger<quint32> fTail;
+	char fPad2[64 - sizeof(QAtomicInteger<quint32>)];
+};
+
+QMidiInBuffer::QMidiInBuffer(int capacity)
+	: notified(0),
+	  dropped(0),
+	  fHead(0),
+	  fTail(0)
+{
+	quint32 size = 2;
+	while (size < (quint32)capacity)
+		size <<= 1;
+	fMask = size - 1;
+	fMessages = new QMidiInMessage[size];
+}
+QMidiInBuffer::~QMidiInBuffer()
+{
+	delete[] fMessages;
+}
+
+bool QMidiInBuffer::push(quint32 message, quint32 timing, qint64 timestamp)
+{
+	const quint32 tail = fTail.load();
+	if (tail - fHead.loadAcquire() > fMask) {
+		dropped.fetchAndAddRelaxed(1);
+		return false;
+	}
+	fMessages[tail & fMask].message = message;
+	fMessages[tail & fMask].timing = timing;
+	fMessages[tail & fMask].timestamp = timestamp;
+	fTail.storeRelease(tail + 1);
+	return true;
+}
+
+int QMidiInBuffer::pop(QMidiInMessage* messages, int max)
+{
+	const quint32 head = fHead.load();
+	const quint32 available = fTail.loadAcquire() - head;
+	const int count = (available < (quint32)max) ? (int)available : max;
+	for (int i = 0; i < count; i++)
+		messages[i] = fMessages[(head + i) & fMask];
+	fHead.storeRelease(head + count);
+	return count;
+}
+
+/* Puts SysEx messages back together from the pieces the backends get. The
+ * messages are assembled in a small pool of buffers with reserved capacity;
+ * a buffer is reused once every QByteArray sharing it was destroyed. */
+class QMidiInSysEx
+{
+public:
+	QMidiInSysEx();
+
+	const QByteArray* append(const char* data, int size, qint64 timestamp);
+
+	int maxSize;
+	qint64 timeout; /* nanoseconds */
+	QAtomicInt dropped;
+
+private:
+	int acquire();
+	void drop();
+
+	QVector<QByteArray> fPool;
+	int fEvict;
+	int fCurrent; /* index of the buffer being assembled, or -1 */
+	qint64 fLast;
+};
+
+static const int kSysExPoolSize = 8;
+static const int kSysExReserve = 4096;
+
+QMidiInSysEx::QMidiInSysEx()
+	: maxSize(1024 * 1024),
+	  timeout(1000000000LL),
+	  dropped(0),
+	  fEvict(0),
+	  fCurrent(-1),
+	  fLast(0)
+{
+}
+
+int QMidiInSysEx::acquire()
+{
+	for (int i = 0; i < fPool.size(); i++) {
+		if (fPool.at(i).isDetached()) {
+			fPool[i].resize(0); /* keeps the reserved capacity */
+			return i;
+		}
+	}
+
+	/* all buffers are still held elsewhere: add one, or let the holders of
+	 * an old one keep it to themselves */
+	int i = fPool.size();
+	if (i < kSysExPoolSize) {
+		fPool.append(QByteArray());
+	} else {
+		i = fEvict;
+		fEvict = (fEvict + 1) % kSysExPoolSize;
+		fPool[i] = QByteArray();
+	}
+	fPool[i].reserve(kSysExReserve);
+	return i;
+}
+
+void QMidiInSysEx::drop()
+{
+	dropped.fetchAndAddRelaxed(1);
+	fCurrent = -1;
+}
+
+/* Returns the complete message once <tt>data</tt> ends it, else nullptr. */
+const QByteArray* QMidiInSysEx::append(const char* data, int size, qint64 timestamp)
+{
+	if (size <= 0)
+		return nullptr;
+
+	if ((unsigned char)data[0] == 0xF0) {
+		if (fCurrent >= 0)
+			drop(); /* never finished */
+		fCurrent = acquire();
+	} else if (fCurrent < 0) {
+		return nullptr; /* the rest of a dropped message */
+	} else if (timestamp - fLast > timeout) {
+		drop();
+		return nullptr;
+	}
+	fLast = timestamp;
+
+	QByteArray& buffer = fPool[fCurrent];
+	if (buffer.size() + size > maxSize) {
+		drop();
+		return nullptr;
+	}
+	buffer.append(data, size);
+
+	if ((unsigned char)data[size - 1] != 0xF7)
+		return nullptr;
+	const int finished = fCurrent;
+	fCurrent = -1;
+	return &fPool.at(finished);
+}
+
 QMidiIn::QMidiIn(QObject *parent)
 	: QObject(parent),
 	fMidiPtrs(nullptr),
+	fBuffer(nullptr),
+	fSysEx(new QMidiInSysEx),
 	fConnected(false)
 {
 }
@@ -15,4 +194,69 @@ QMidiIn::~QMidiIn()
 {
 	if (fConnected)
 		disconnect();
+	delete fBuffer;
+	delete fSysEx;
+}
+
+void QMidiIn::setBuffered(bool buffered, int capacity)
+{
+	delete fBuffer;
+	fBuffer = buffered ? new QMidiInBuffer(capacity) : nullptr;
+}
+
+int QMidiIn::readMessages(QMidiInMessage* messages, int max)
+{
+	if (fBuffer == nullptr)
+		return 0;
+
+	/* re-arm the signal before reading, so messages arriving from now on are
+	 * announced even if this call doesn't get to them */
+	fBuffer->notified.fetchAndStoreOrdered(0);
+	return fBuffer->pop(messages, max);
+}
+
+int QMidiIn::droppedCount() const
+{
+	return (fBuffer != nullptr) ? fBuffer->dropped.load() : 0;
+}
+
+void QMidiIn::setSysExLimits(int maxSize, int timeoutMsecs)
+{
+	fSysEx->maxSize = maxSize;
+	fSysEx->timeout = (qint64)timeoutMsecs * 1000000;
+}
+
+int QMidiIn::sysExDroppedCount() const
+{
+	return fSysEx->dropped.load();
+}
+
+qint64 QMidiIn::timestampNow()
+{
+#if defined(Q_OS_MACOS)
+	/* CoreMIDI stamps packets with host time; steady_clock isn't guaranteed
+	 * to be the same clock (older libc++ keeps counting during sleep) */
+	return (qint64)AudioConvertHostTimeToNanos(AudioGetCurrentHostTime());
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void QMidiIn::dispatchMessage(quint32 message, quint32 timing, qint64 timestamp)
+{
+	if (fBuffer == nullptr) {
+		emit midiEvent(message, timing);
+		return;
+	}
+
+	if (fBuffer->push(message, timing, timestamp) && (fBuffer->notified.fetchAndStoreOrdered(1) == 0))
+		emit midiEventsAvailable();
+}
+
+void QMidiIn::dispatchSysEx(const char* data, int size, qint64 timestamp)
+{
+	const QByteArray* message = fSysEx->append(data, size, timestamp);
+	if (message != nullptr)
+		emit midiSysExEvent(*message);
 }
@@ -8,8 +8,23 @@
 #include <QString>
 #include <QObject>
 
+class QMidiInBuffer;
+class QMidiInSysEx;
 struct NativeMidiInInstances;
 
+//! \brief The QMidiInMessage struct holds a message read with
+//! QMidiIn::readMessages.
+struct QMidiInMessage
+{
+	//! \brief message The MIDI message, as in QMidiIn::midiEvent.
+	quint32 message;
+	//! \brief timing Timing information provided by the operating system.
+	quint32 timing;
+	//! \brief timestamp The arrival time in nanoseconds, on the clock of
+	//! QMidiIn::timestampNow.
+	qint64 timestamp;
+};
+
 class QMidiIn : public QObject
 {
 	Q_OBJECT
@@ -45,6 +60,59 @@ public:
 	//! \return The device ID used to connect with.
 	QString deviceId() const { return fDeviceId; }
 
+	//! \brief setBuffered Sets whether received messages are kept in a ring
+	//! buffer instead of being emitted one by one with midiEvent.
+	//!
+	//! In buffered mode, receiving a message never allocates: it is copied
+	//! into a buffer preallocated here, and midiEventsAvailable is emitted
+	//! once for every batch. The messages can then be read with readMessages
+	//! from any one thread at a time, each with the time it arrived at. Must
+	//! be called while stopped.
+	//! \param buffered \c true to buffer messages.
+	//! \param capacity The number of messages the buffer holds, rounded up to
+	//! a power of two.
+	void setBuffered(bool buffered, int capacity = 4096);
+	//! \brief isBuffered Returns whether buffered mode is on.
+	bool isBuffered() const { return fBuffer != nullptr; }
+	//! \brief readMessages Moves up to <tt>max</tt> buffered messages into
+	//! <tt>messages</tt>, oldest first.
+	//!
+	//! Call it until it returns 0 after every midiEventsAvailable signal, or
+	//! poll it regularly instead of connecting to the signal.
+	//! \return The number of messages read.
+	int readMessages(QMidiInMessage* messages, int max);
+	//! \brief droppedCount Returns how many messages were dropped because the
+	//! buffer was full.
+	int droppedCount() const;
+
+	//! \brief setSysExLimits Sets the limits for reassembling SysEx messages
+	//! that arrive in pieces.
+	//!
+	//! A message is dropped when it grows larger than <tt>maxSize</tt>, or
+	//! when more than <tt>timeoutMsecs</tt> pass between two of its pieces.
+	//! By default, the limits are 1 MiB and 1000 ms.
+	void setSysExLimits(int maxSize, int timeoutMsecs);
+	//! \brief sysExDroppedCount Returns how many SysEx messages were dropped
+	//! because of the limits, or because they were never finished.
+	int sysExDroppedCount() const;
+
+	//! \brief timestampNow Returns the current time on the clock used for
+	//! QMidiInMessage::timestamp, in nanoseconds.
+	//!
+	//! This is \c std::chrono::steady_clock, i.e. the monotonic clock that
+	//! QElapsedTimer also uses, or the CoreAudio host time on macOS, so the
+	//! age of a message is <tt>timestampNow() - message.timestamp</tt>.
+	static qint64 timestampNow();
+
+	//! \brief dispatchMessage Hands a received message to buffered mode or to
+	//! midiEvent. Called by the backends from their receiving thread.
+	//! \param timestamp The arrival time, see timestampNow.
+	void dispatchMessage(quint32 message, quint32 timing, qint64 timestamp);
+	//! \brief dispatchSysEx Adds a piece of a SysEx message, emitting
+	//! midiSysExEvent once the message is complete. Called by the backends
+	//! from their receiving thread.
+	void dispatchSysEx(const char* data, int size, qint64 timestamp);
+
 signals:
 	//! \brief midiEvent This signal is emitted when a basic MIDI event is
 	//! received.
@@ -67,12 +135,25 @@ signals:
 	void midiEvent(quint32 message, quint32 timing);
 	//! \brief midiSysExEvent This signal is emitted when a MIDI System
 	//! Exclusive (SysEx) event is received.
+	//!
+	//! Messages the system delivers in pieces are put back together first.
+	//! <tt>data</tt> shares its memory with a buffer that is reused for later
+	//! messages once all copies of it are gone, so no copy is made unless
+	//! the receiver modifies it.
 	//! \param data The received SysEx data, including the SysEx start (0xF0)
 	//! and end bytes (0xF7).
 	void midiSysExEvent(QByteArray data);
+	//! \brief midiEventsAvailable This signal is emitted in buffered mode
+	//! when messages arrive after the buffer was drained with readMessages.
+	//!
+	//! It is not emitted again until readMessages is called, so a burst of
+	//! messages only queues one signal.
+	void midiEventsAvailable();
 
 private:
 	QString fDeviceId;
 	NativeMidiInInstances* fMidiPtrs;
+	QMidiInBuffer* fBuffer;
+	QMidiInSysEx* fSysEx;
 	bool fConnected;
 };
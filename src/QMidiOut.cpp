@@ -6,11 +6,155 @@
 
 #include "QMidiFile.h"
 
+#include <QAtomicInteger>
+#include <QSemaphore>
+#include <QThread>
+
 // TODO: error reporting
 
+/* Delivers the messages posted from any thread. The queue is Dmitry Vyukov's
+ * bounded MPMC queue with a single consumer: every cell carries a sequence
+ * number telling producers and the consumer whose turn it is, so producers
+ * only ever race on one compare-and-swap of the enqueue position. */
+class QMidiOutSender : public QThread
+{
+public:
+	QMidiOutSender(QMidiOut* out, int capacity);
+	~QMidiOutSender();
+
+	bool push(quint32 msg);
+	void stop();
+
+	QAtomicInt overflows;
+
+protected:
+	void run() override;
+
+private:
+	int pop(quint32* msgs, int max);
+
+	struct Cell {
+		QAtomicInteger<quint32> sequence;
+		quint32 msg;
+	};
+
+	QMidiOut* fOut;
+	Cell* fCells;
+	quint32 fMask;
+
+	/* padded onto cache lines of their own, as producers and the consumer
+	 * write them concurrently; alignas() isn't honoured by new before C++17 */
+	char fPad0[64];
+	QAtomicInteger<quint32> fEnqueuePos;
+	char fPad1[64 - sizeof(QAtomicInteger<quint32>)];
+	quint32 fDequeuePos;
+	char fPad2[64 - sizeof(quint32)];
+
+	QAtomicInt fSleeping;
+	QAtomicInt fStopRequested;
+	QSemaphore fWake;
+};
+
+QMidiOutSender::QMidiOutSender(QMidiOut* out, int capacity)
+	: overflows(0),
+	  fOut(out),
+	  fEnqueuePos(0),
+	  fDequeuePos(0),
+	  fSleeping(0),
+	  fStopRequested(0)
+{
+	quint32 size = 2;
+	while (size < (quint32)capacity)
+		size <<= 1;
+	fMask = size - 1;
+	fCells = new Cell[size];
+	for (quint32 i = 0; i < size; i++)
+		fCells[i].sequence.store(i);
+}
+QMidiOutSender::~QMidiOutSender()
+{
+	delete[] fCells;
+}
+
+bool QMidiOutSender::push(quint32 msg)
+{
+	Cell* cell;
+	quint32 pos = fEnqueuePos.load();
+	forever {
+		cell = &fCells[pos & fMask];
+		const qint32 diff = (qint32)(cell->sequence.loadAcquire() - pos);
+		if (diff == 0) {
+			if (fEnqueuePos.testAndSetRelaxed(pos, pos + 1))
+				break;
+			pos = fEnqueuePos.load();
+		} else if (diff < 0) {
+			/* the consumer hasn't freed this cell yet: full */
+			overflows.fetchAndAddRelaxed(1);
+			return false;
+		} else {
+			pos = fEnqueuePos.load();
+		}
+	}
+	cell->msg = msg;
+	cell->sequence.storeRelease(pos + 1);
+
+	if (fSleeping.fetchAndStoreOrdered(0) == 1)
+		fWake.release();
+	return true;
+}
+
+int QMidiOutSender::pop(quint32* msgs, int max)
+{
+	int count = 0;
+	while (count < max) {
+		Cell* cell = &fCells[fDequeuePos & fMask];
+		if ((qint32)(cell->sequence.loadAcquire() - (fDequeuePos + 1)) < 0)
+			break;
+		msgs[count++] = cell->msg;
+		cell->sequence.storeRelease(fDequeuePos + fMask + 1);
+		fDequeuePos++;
+	}
+	return count;
+}
+
+void QMidiOutSender::stop()
+{
+	fStopRequested.storeRelease(1);
+	fWake.release();
+	wait();
+}
+
+void QMidiOutSender::run()
+{
+	quint32 msgs[256];
+	forever {
+		int count = pop(msgs, 256);
+		if (count == 0) {
+			/* announce the sleep before checking once more, so a producer
+			 * pushing in between is sure to see it and wake us up */
+			fSleeping.fetchAndStoreOrdered(1);
+			count = pop(msgs, 256);
+			if (count == 0) {
+				if (fStopRequested.loadAcquire())
+					break;
+				fWake.acquire();
+				continue;
+			}
+			fSleeping.fetchAndStoreOrdered(0);
+		}
+		/* the sender has the output to itself while it runs, so it hands
+		 * each batch over at once without going through fAutoFlush */
+		for (int i = 0; i < count; i++)
+			fOut->outputMsg(msgs[i]);
+		fOut->flush();
+	}
+}
+
 QMidiOut::QMidiOut()
 	: fMidiPtrs(NULL),
-	  fConnected(false)
+	  fSender(NULL),
+	  fConnected(false),
+	  fAutoFlush(true)
 {
 }
 QMidiOut::~QMidiOut()
@@ -19,6 +163,13 @@ QMidiOut::~QMidiOut()
 		disconnect();
 }
 
+void QMidiOut::sendMsg(qint32 msg)
+{
+	outputMsg(msg);
+	if (fAutoFlush)
+		flush();
+}
+
 void QMidiOut::sendEvent(const QMidiEvent& e)
 {
 	if (e.type() == QMidiEvent::SysEx) {
@@ -29,6 +180,69 @@ void QMidiOut::sendEvent(const QMidiEvent& e)
 	sendMsg(e.message());
 }
 
+/* Flushes only once at the end, so buffering backends hand the whole batch
+ * to the system at once. */
+void QMidiOut::sendMsgs(const quint32* msgs, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		outputMsg(msgs[i]);
+	if (fAutoFlush)
+		flush();
+}
+
+void QMidiOut::sendEvents(const QList<QMidiEvent*>& events)
+{
+	const bool autoFlush = fAutoFlush;
+	fAutoFlush = false;
+	for (int i = 0; i < events.size(); i++)
+		sendEvent(*events.at(i));
+	fAutoFlush = autoFlush;
+	if (fAutoFlush)
+		flush();
+}
+
+bool QMidiOut::startAsync(int capacity)
+{
+	if (!fConnected)
+		return false;
+	if (fSender != NULL)
+		stopAsync();
+
+	fSender = new QMidiOutSender(this, capacity);
+	fSender->start(QThread::TimeCriticalPriority);
+	return true;
+}
+
+void QMidiOut::stopAsync()
+{
+	if (fSender == NULL)
+		return;
+
+	fSender->stop();
+	delete fSender;
+	fSender = NULL;
+}
+
+bool QMidiOut::postMsg(qint32 msg)
+{
+	if (fSender == NULL) {
+		sendMsg(msg);
+		return true;
+	}
+	return fSender->push(msg);
+}
+
+int QMidiOut::overflowCount() const
+{
+	return (fSender != NULL) ? fSender->overflows.load() : 0;
+}
+
+void QMidiOut::resetOverflowCount()
+{
+	if (fSender != NULL)
+		fSender->overflows.store(0);
+}
+
 void QMidiOut::setInstrument(int voice, int instr)
 {
 	qint32 msg = 0xC0 + voice;
@@ -85,8 +299,10 @@ void QMidiOut::controlChange(int voice, int number, int value)
 
 void QMidiOut::stopAll()
 {
+	quint32 msgs[16];
 	for (int i = 0; i < 16; i++)
-		stopAll(i);
+		msgs[i] = (0xB0 | i) | (0x7B << 8);
+	sendMsgs(msgs, 16);
 }
 
 void QMidiOut::stopAll(int voice)
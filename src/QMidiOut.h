@@ -4,10 +4,12 @@
  */
 #pragma once
 
+#include <QList>
 #include <QMap>
 #include <QString>
 
 class QMidiEvent;
+class QMidiOutSender;
 struct NativeMidiOutInstances;
 
 class QMidiOut
@@ -25,6 +27,77 @@ public:
 	void sendSysEx(const QByteArray &data);
 
 	void sendEvent(const QMidiEvent& e);
+
+	//! \brief sendMsgs Sends <tt>count</tt> raw messages, flushing once at
+	//! the end instead of after each one.
+	void sendMsgs(const quint32* msgs, size_t count);
+	//! \brief sendEvents Sends all <tt>events</tt>, flushing once at the end.
+	void sendEvents(const QList<QMidiEvent*>& events);
+
+	//! \brief setAutoFlush Sets whether every message is handed to the system
+	//! as soon as it is sent.
+	//!
+	//! With auto-flush off, backends that buffer output (ALSA) keep messages
+	//! until flush() is called or their buffer fills up, which saves a system
+	//! call per message when sending many at once. On by default.
+	void setAutoFlush(bool autoFlush) { fAutoFlush = autoFlush; }
+	bool autoFlush() const { return fAutoFlush; }
+	//! \brief flush Hands all buffered and scheduled messages to the system.
+	void flush();
+
+	//! \brief startSchedule Starts the clock that scheduled messages are
+	//! timed against, dropping anything still scheduled where stopSchedule()
+	//! can.
+	//!
+	//! Scheduled messages are handed to the operating system ahead of time
+	//! and delivered by it, so the application only needs to wake up now and
+	//! then to schedule the next batch.
+	//! \return \c true if the backend delivers scheduled messages on time
+	//! (ALSA, CoreMIDI, Haiku), \c false if it sends them right away (Windows).
+	//! Only ALSA and CoreMIDI can take scheduled messages back, see
+	//! stopSchedule().
+	bool startSchedule();
+	//! \brief stopSchedule Stops the schedule clock, dropping all messages
+	//! not delivered yet on ALSA and CoreMIDI.
+	//!
+	//! On Haiku, messages that were already scheduled still play at their
+	//! time, because the Midi Kit can't take them back. Windows has nothing
+	//! to drop, since it sent them right away.
+	void stopSchedule();
+	//! \brief scheduleMsg Sends <tt>msg</tt> <tt>nsecs</tt> nanoseconds after
+	//! startSchedule() was called. Call flush() after a batch.
+	void scheduleMsg(qint32 msg, qint64 nsecs);
+	//! \brief scheduleSysEx Like scheduleMsg(), for a SysEx message.
+	void scheduleSysEx(const QByteArray &data, qint64 nsecs);
+
+	//! \brief startAsync Starts a sender thread that delivers messages
+	//! posted with postMsg().
+	//!
+	//! postMsg() may then be called from any number of threads at once. The
+	//! messages go through a lock-free queue, so producers never wait on each
+	//! other or on the system, and the sender hands them to the system in
+	//! batches. Other sending functions must not be used meanwhile.
+	//! \param capacity The number of messages the queue holds, rounded up to
+	//! a power of two.
+	//! \return \c false if not connected.
+	bool startAsync(int capacity = 4096);
+	//! \brief stopAsync Sends everything still queued, then stops the sender
+	//! thread. Called by disconnect().
+	void stopAsync();
+	bool isAsync() const { return fSender != NULL; }
+	//! \brief postMsg Queues <tt>msg</tt> for the sender thread.
+	//!
+	//! Only once startAsync() was called is this thread-safe and never
+	//! blocking. Before that it is just sendMsg(): it must be called from the
+	//! thread that owns this object, and it waits for the system like
+	//! sendMsg() does.
+	//! \return \c false if the queue is full and the message was dropped.
+	bool postMsg(qint32 msg);
+	//! \brief overflowCount Returns how many messages postMsg() dropped
+	//! because the queue was full.
+	int overflowCount() const;
+	void resetOverflowCount();
+
 	void setInstrument(int voice, int instr);
 	void noteOn(int note, int voice, int velocity = 64);
 	void noteOff(int note, int voice, int velocity = 0);
@@ -39,7 +112,15 @@ public:
 	QString deviceId() const { return fDeviceId; }
 
 private:
+	friend class QMidiOutSender;
+
+	//! \brief outputMsg Sends <tt>msg</tt> without flushing, whatever
+	//! autoFlush() is set to. Implemented by each backend.
+	void outputMsg(qint32 msg);
+
 	QString fDeviceId;
 	NativeMidiOutInstances* fMidiPtrs;
+	QMidiOutSender* fSender;
 	bool fConnected;
+	bool fAutoFlush;
 };
@@ -0,0 +1,254 @@
+/*
+ * Copyright 2012-2016 Augustin Cavalier <waddlesplash>
+ * All rights reserved. Distributed under the terms of the MIT license.
+ */
+#include "QMidiPlayer.h"
+
+#include "QMidiFile.h"
+#include "QMidiOut.h"
+
+#include <QDeadlineTimer>
+
+#include <algorithm>
+
+QMidiPlayer::QMidiPlayer(QMidiFile* file, QMidiOut* out, QObject* parent)
+	: QThread(parent),
+	  fFile(file),
+	  fOut(out),
+	  fNext(0),
+	  fPosition(0),
+	  fOrigin(0),
+	  fPrepared(false),
+	  fPaused(false),
+	  fStopRequested(false),
+	  fSeekPending(false),
+	  fSeekTick(0),
+	  fSpinTime(2000000),
+	  fMaxLateness(0),
+	  fTotalLateness(0),
+	  fLateEvents(0)
+{
+	fClock.start();
+}
+QMidiPlayer::~QMidiPlayer()
+{
+	stop();
+}
+
+/* Takes a snapshot of the events and converts all their ticks to times at
+ * once, so the playing thread doesn't touch the file. */
+void QMidiPlayer::prepare()
+{
+	fEvents = fFile->events();
+	QVector<qint32> ticks(fEvents.size());
+	for (int i = 0; i < fEvents.size(); i++) {
+		ticks[i] = fEvents.at(i)->tick();
+	}
+	fTimes.resize(ticks.size());
+	fFile->nanosecondsFromTicks(ticks.constData(), fTimes.data(), ticks.size());
+	fNext = 0;
+	fPosition = 0;
+	fPrepared = true;
+}
+
+void QMidiPlayer::seekLocked(qint32 tick)
+{
+	QList<QMidiEvent*>::const_iterator it =
+		std::lower_bound(fEvents.constBegin(), fEvents.constEnd(), tick,
+						 [](QMidiEvent* e, qint32 t) { return e->tick() < t; });
+	fNext = it - fEvents.constBegin();
+	fFile->nanosecondsFromTicks(&tick, &fPosition, 1);
+	fOrigin = fClock.nsecsElapsed() - fPosition;
+}
+
+void QMidiPlayer::silence()
+{
+	fOut->stopAll();
+}
+
+void QMidiPlayer::play()
+{
+	QMutexLocker locker(&fMutex);
+	if (isRunning()) {
+		fPaused = false;
+		fWake.wakeAll();
+		return;
+	}
+	if (!fPrepared || (fNext >= fEvents.size())) {
+		prepare();
+	}
+	fPaused = false;
+	fStopRequested = false;
+	fSeekPending = false;
+	locker.unlock();
+	start(QThread::TimeCriticalPriority);
+}
+
+void QMidiPlayer::pause()
+{
+	QMutexLocker locker(&fMutex);
+	if (isRunning() && !fPaused) {
+		fPaused = true;
+		fPosition = fClock.nsecsElapsed() - fOrigin;
+		fWake.wakeAll();
+	}
+}
+
+void QMidiPlayer::stop()
+{
+	fMutex.lock();
+	fStopRequested = true;
+	fWake.wakeAll();
+	fMutex.unlock();
+
+	wait();
+
+	QMutexLocker locker(&fMutex);
+	fPrepared = false;
+	fPaused = false;
+	fStopRequested = false;
+	fSeekPending = false;
+	fNext = 0;
+	fPosition = 0;
+}
+
+void QMidiPlayer::seek(qint32 tick)
+{
+	QMutexLocker locker(&fMutex);
+	if (isRunning()) {
+		fSeekTick = tick;
+		fSeekPending = true;
+		fWake.wakeAll();
+		return;
+	}
+	if (!fPrepared) {
+		prepare();
+	}
+	seekLocked(tick);
+}
+
+bool QMidiPlayer::isPlaying()
+{
+	QMutexLocker locker(&fMutex);
+	return isRunning() && !fPaused;
+}
+
+qint32 QMidiPlayer::position()
+{
+	QMutexLocker locker(&fMutex);
+	qint64 position = fPosition;
+	if (isRunning() && !fPaused) {
+		position = fClock.nsecsElapsed() - fOrigin;
+	}
+	return fFile->tickFromTime(position / 1000000000.0);
+}
+
+void QMidiPlayer::setSpinTime(int usecs)
+{
+	QMutexLocker locker(&fMutex);
+	fSpinTime = (qint64)usecs * 1000;
+}
+
+qint64 QMidiPlayer::maxLateness()
+{
+	QMutexLocker locker(&fMutex);
+	return fMaxLateness;
+}
+
+qint64 QMidiPlayer::averageLateness()
+{
+	QMutexLocker locker(&fMutex);
+	return (fLateEvents > 0) ? (fTotalLateness / fLateEvents) : 0;
+}
+
+void QMidiPlayer::resetLateness()
+{
+	QMutexLocker locker(&fMutex);
+	fMaxLateness = 0;
+	fTotalLateness = 0;
+	fLateEvents = 0;
+}
+
+void QMidiPlayer::run()
+{
+	QMutexLocker locker(&fMutex);
+	fOrigin = fClock.nsecsElapsed() - fPosition;
+
+	forever {
+		if (fStopRequested) {
+			silence();
+			break;
+		}
+		if (fSeekPending) {
+			fSeekPending = false;
+			silence();
+			seekLocked(fSeekTick);
+			continue;
+		}
+		if (fPaused) {
+			silence();
+			while (fPaused && !fStopRequested && !fSeekPending) {
+				fWake.wait(&fMutex);
+			}
+			fOrigin = fClock.nsecsElapsed() - fPosition;
+			continue;
+		}
+		if (fNext >= fEvents.size()) {
+			break;
+		}
+
+		/* sleep until shortly before the deadline, waking up early for any
+		 * transport change, then spin the rest of the way */
+		const qint64 deadline = fOrigin + fTimes.at(fNext);
+		const qint64 sleep_ns = deadline - fSpinTime - fClock.nsecsElapsed();
+		if (sleep_ns > 0) {
+			QDeadlineTimer wake_up(Qt::PreciseTimer);
+			wake_up.setPreciseRemainingTime(0, sleep_ns, Qt::PreciseTimer);
+			fWake.wait(&fMutex, wake_up);
+			continue;
+		}
+		locker.unlock();
+		while (fClock.nsecsElapsed() < deadline) {
+		}
+		locker.relock();
+		if (fStopRequested || fSeekPending || fPaused) {
+			continue;
+		}
+
+		/* send everything that is due, e.g. a whole chord, in one flush; the
+		 * events only reach the system with the flush, so lateness is taken
+		 * after it. Only this thread changes the events, fNext and fOrigin
+		 * while playing, so the lock is let go meanwhile and position() and
+		 * the transport don't wait for the output. */
+		const qint64 origin = fOrigin;
+		locker.unlock();
+		const bool autoFlush = fOut->autoFlush();
+		fOut->setAutoFlush(false);
+		int sent = 0;
+		qint64 first_deadline = 0;
+		qint64 deadline_sum = 0;
+		while ((fNext < fEvents.size()) &&
+			   (origin + fTimes.at(fNext) <= fClock.nsecsElapsed())) {
+			QMidiEvent* e = fEvents.at(fNext);
+			if (e->type() != QMidiEvent::Meta) {
+				fOut->sendEvent(*e);
+				if (sent++ == 0)
+					first_deadline = origin + fTimes.at(fNext);
+				deadline_sum += origin + fTimes.at(fNext);
+			}
+			fNext++;
+		}
+		fOut->setAutoFlush(autoFlush);
+		fOut->flush();
+		const qint64 now = fClock.nsecsElapsed();
+		locker.relock();
+
+		if (sent > 0) {
+			fMaxLateness = qMax(fMaxLateness, now - first_deadline);
+			fTotalLateness += now * sent - deadline_sum;
+			fLateEvents += sent;
+		}
+	}
+
+	fPosition = fClock.nsecsElapsed() - fOrigin;
+}
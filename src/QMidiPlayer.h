@@ -0,0 +1,96 @@
+/*
+ * Copyright 2012-2016 Augustin Cavalier <waddlesplash>
+ * All rights reserved. Distributed under the terms of the MIT license.
+ */
+#pragma once
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+class QMidiEvent;
+class QMidiFile;
+class QMidiOut;
+
+//! \brief The QMidiPlayer class plays a QMidiFile through a QMidiOut on its
+//! own thread.
+//!
+//! Every event is sent at an absolute deadline on a monotonic clock, so
+//! timing errors don't add up over the piece. The thread sleeps until shortly
+//! before each deadline and spins for the rest, which keeps jitter well below
+//! a millisecond. The file and the output must not be changed or used
+//! elsewhere while playing.
+class QMidiPlayer : public QThread
+{
+	Q_OBJECT
+public:
+	explicit QMidiPlayer(QMidiFile* file, QMidiOut* out, QObject* parent = nullptr);
+	~QMidiPlayer();
+
+	//! \brief play Starts playing from the current position, or resumes after
+	//! pause().
+	void play();
+	//! \brief pause Pauses playback, silencing all sounding notes.
+	void pause();
+	//! \brief stop Stops playback and rewinds to the start of the file.
+	void stop();
+	//! \brief seek Moves playback to <tt>tick</tt>, while playing or not.
+	void seek(qint32 tick);
+
+	//! \brief isPlaying Returns whether the player is playing (and not paused).
+	bool isPlaying();
+	//! \brief position Returns the tick currently being played.
+	qint32 position();
+
+	//! \brief setSpinTime Sets how long before each deadline the player stops
+	//! sleeping and spins instead.
+	//!
+	//! Longer times cost more CPU, but hide coarse sleep timers (on Windows,
+	//! sleeps may overshoot by several milliseconds).
+	//! \param usecs The time in microseconds, 2000 by default.
+	void setSpinTime(int usecs);
+
+	//! \brief maxLateness Returns the largest delay, in nanoseconds, between
+	//! an event's deadline and the moment it was sent.
+	qint64 maxLateness();
+	//! \brief averageLateness Returns the average delay in nanoseconds.
+	qint64 averageLateness();
+	//! \brief resetLateness Clears the lateness statistics.
+	void resetLateness();
+
+protected:
+	void run() override;
+
+private:
+	void prepare();
+	void seekLocked(qint32 tick);
+	void silence();
+
+	QMidiFile* fFile;
+	QMidiOut* fOut;
+
+	QMutex fMutex;
+	QWaitCondition fWake;
+	QElapsedTimer fClock;
+
+	/* all guarded by fMutex; while playing, only the playing thread changes
+	 * fEvents, fTimes, fNext and fOrigin, and it reads them without it */
+	QList<QMidiEvent*> fEvents;
+	QVector<qint64> fTimes; /* nanoseconds from the start of the file */
+	int fNext;
+	qint64 fPosition;		/* nanoseconds, while not playing */
+	qint64 fOrigin;			/* fClock time of the start of the file, while playing */
+	bool fPrepared;
+	bool fPaused;
+	bool fStopRequested;
+	bool fSeekPending;
+	qint32 fSeekTick;
+	qint64 fSpinTime;
+
+	qint64 fMaxLateness;
+	qint64 fTotalLateness;
+	qint64 fLateEvents;
+};